@@ -15,6 +15,7 @@ int main(int argc, char** argv) {
   float xy_res = UNSET_FLOAT;
   float step = UNSET_FLOAT;
   unsigned int bit_depth = UNSET_UNSIGNED_INT;
+  std::string compression = "";
   unsigned int threadnum = UNSET_UNSIGNED_INT;
   bool overwrite = UNSET_BOOL;
   bool verbose = UNSET_BOOL;
@@ -28,6 +29,7 @@ int main(int argc, char** argv) {
       ("xy-rez,x", po::value<float>(&xy_res)->default_value(-1.0f), "x/y resolution (um/px)")
       ("step,s", po::value<float>(&step)->default_value(-1.0f), "step/interval (um)")
       ("bit-depth,b", po::value<unsigned int>(&bit_depth)->default_value(16),"bit depth (8, 16, or 32) of output image")
+      ("compression", po::value<std::string>(&compression)->default_value("none"),"lossless compression of output TIFFs (none, lzw, deflate, or zstd)")
       ("thread,t", po::value<unsigned int>(&threadnum)->default_value(1),"number of threads")
       ("overwrite,w", po::value<bool>(&overwrite)->default_value(false)->implicit_value(true)->zero_tokens(), "overwrite output if it exists")
       ("verbose,v", po::value<bool>(&verbose)->default_value(false)->implicit_value(true)->zero_tokens(), "display progress and debug information")
@@ -100,6 +102,13 @@ int main(int argc, char** argv) {
     return EXIT_FAILURE;
   }
 
+  // check compression
+  uint16_t compression_scheme = COMPRESSION_NONE;
+  if (!ParseTiffCompression(compression, compression_scheme)) {
+    std::cerr << "crop: compression must be none, lzw, deflate, or zstd, and supported by the TIFF library" << std::endl;
+    return EXIT_FAILURE;
+  }
+
   //cropping
   std::string crop_params_str = varsmap["crop"].as<std::string>().c_str();
   std::stringstream ss(crop_params_str);
@@ -131,6 +140,7 @@ int main(int argc, char** argv) {
     std::cout << "Input Path = " << in_path << "\n";
     std::cout << "Output Path = " << out_path << "\n";
     std::cout << "Overwrite = " << overwrite << "\n";
+    std::cout << "Compression = " << compression << "\n";
     std::cout << "Bit Depth = " << bit_depth << std::endl;
     std::cout << "X/Y Resolution (um/px) = " << xy_res << "\n";
     std::cout << "Step Size (um) = " << step << "\n";
@@ -156,15 +166,15 @@ int main(int argc, char** argv) {
   if (bit_depth == 8) {
     using PixelTypeOut = unsigned char;
     using ImageTypeOut = itk::Image<PixelTypeOut, kDimensions>;
-    WriteImageFile<kImageType,ImageTypeOut>(cropped_img, out_path, verbose, false);
+    WriteImageFile<kImageType,ImageTypeOut>(cropped_img, out_path, verbose, false, true, "", compression_scheme);
   } else if (bit_depth == 16) {
     using PixelTypeOut = unsigned short;
     using ImageTypeOut = itk::Image<PixelTypeOut, kDimensions>;
-    WriteImageFile<kImageType,ImageTypeOut>(cropped_img, out_path, verbose, false);
+    WriteImageFile<kImageType,ImageTypeOut>(cropped_img, out_path, verbose, false, true, "", compression_scheme);
   } else if (bit_depth == 32) {
     using PixelTypeOut = float;
     using ImageTypeOut = itk::Image<PixelTypeOut, kDimensions>;
-    WriteImageFile<kImageType,ImageTypeOut>(cropped_img, out_path, verbose, false);
+    WriteImageFile<kImageType,ImageTypeOut>(cropped_img, out_path, verbose, false, true, "", compression_scheme);
   } else {
     std::cerr << "crop: unknown bit depth" << std::endl;
     return EXIT_FAILURE;
@@ -9,10 +9,11 @@
 #include <itkExtractImageFilter.h>
 #include <itkMultiThreaderBase.h>
 
-kImageType::Pointer Crop(kImageType::Pointer img, float z_step, float xy_res, int top, int bottom, int left, int right, int front, int back, bool verbose=false)
+template <class TImage>
+itk::SmartPointer<TImage> Crop(itk::SmartPointer<TImage> img, float z_step, float xy_res, int top, int bottom, int left, int right, int front, int back, bool verbose=false)
 {
     // calculate and set output size
-    kImageType::SizeType size = img->GetLargestPossibleRegion().GetSize();
+    typename TImage::SizeType size = img->GetLargestPossibleRegion().GetSize();
 
     if (verbose)
     {
@@ -20,23 +21,23 @@ kImageType::Pointer Crop(kImageType::Pointer img, float z_step, float xy_res, in
         std::cout << "Output Dimensions (px) = " << size[0] - left - right << " x " << size[1] - top - bottom << " x " << size[2] - front - back << "\n";
     }
     
-    kImageType::IndexType desiredStart;
+    typename TImage::IndexType desiredStart;
     desiredStart.SetElement(0, left);
     desiredStart.SetElement(1, top);
     desiredStart.SetElement(2, front);
 
-    kImageType::SizeType desiredSize;
+    typename TImage::SizeType desiredSize;
     desiredSize.SetElement(0, size[0] - left - right);
     desiredSize.SetElement(1, size[1] - top - bottom);
     desiredSize.SetElement(2, size[2] - front - back);
 
-    kImageType::RegionType desiredRegion(desiredStart, desiredSize);
+    typename TImage::RegionType desiredRegion(desiredStart, desiredSize);
 
     if (verbose)
         std::cout << "desiredRegion: " << desiredRegion << std::endl;
 
-    using FilterType = itk::ExtractImageFilter<kImageType, kImageType>;
-    FilterType::Pointer filter = FilterType::New();
+    using FilterType = itk::ExtractImageFilter<TImage, TImage>;
+    typename FilterType::Pointer filter = FilterType::New();
     filter->SetExtractionRegion(desiredRegion);
     filter->SetInput(img);
     #if ITK_VERSION_MAJOR >= 4
@@ -44,7 +45,7 @@ kImageType::Pointer Crop(kImageType::Pointer img, float z_step, float xy_res, in
     #endif
     filter->Update();
 
-    kImageType::Pointer outimg = filter->GetOutput();
+    itk::SmartPointer<TImage> outimg = filter->GetOutput();
 
     // set spacing
     //kImageType::SpacingType spacing;
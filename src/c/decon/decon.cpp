@@ -1,12 +1,21 @@
 #include "decon.h"
+#include "wisdom.h"
+#include "otf.h"
+#include "rl.h"
+#include "tiling.h"
 #include "defines.h"
 #include "utils.h"
 #include "reader.h"
 #include "resampler.h"
-#include "math_local.h"
+#include "background.h"
 #include "writer.h"
 #include <algorithm>
 #include <chrono>
+#include <future>
+#include <memory>
+#include <set>
+#include <sstream>
+#include <boost/filesystem.hpp>
 #include <boost/program_options.hpp>
 
 namespace po = boost::program_options;
@@ -17,25 +26,57 @@ int main(int argc, char** argv) {
   float kernel_zstep = UNSET_FLOAT;
   float img_zstep = UNSET_FLOAT;
   float subtract_constant = UNSET_FLOAT;
+  float background_percentile = UNSET_FLOAT;
+  float max_memory = UNSET_FLOAT;
+  float tolerance = UNSET_FLOAT;
   unsigned int iterations = UNSET_UNSIGNED_INT;
   unsigned int bit_depth = UNSET_UNSIGNED_INT;
+  std::string compression = "";
   unsigned int threadnum = UNSET_UNSIGNED_INT;
+  unsigned int tile_workers = UNSET_UNSIGNED_INT;
+  bool accelerate = UNSET_BOOL;
   bool overwrite = UNSET_BOOL;
   bool verbose = UNSET_BOOL;
+  std::string plan_rigor = "";
+  std::string wisdom_dir = "";
+  std::string otf_dir = "";
+  std::string input_list = "";
+  std::string stop = "";
+  std::string engine = "";
+  std::string pad_mode_name = "";
+  std::string background_path = "";
 
   // declare the supported options
-  po::options_description visible_opts("usage: decon [options] path\n\nAllowed options");
+  po::options_description visible_opts("usage: decon [options] path [path ...]\n\nAllowed options");
   visible_opts.add_options()
       ("help,h", "display this help message")
       ("kernel,k", po::value<std::string>()->required(),"kernel file path")
-      ("iterations,n", po::value<unsigned int>(&iterations)->required(),"deconvolution iterations")
+      ("iterations,n", po::value<unsigned int>(&iterations)->required(),"deconvolution iterations (the maximum when a stopping criterion is set)")
+      ("accelerate,a", po::value<bool>(&accelerate)->default_value(false)->implicit_value(true)->zero_tokens(), "accelerate Richardson-Lucy with vector extrapolation")
+      ("stop", po::value<std::string>(&stop)->default_value("none"),"stopping criterion (none, change, or divergence)")
+      ("tolerance", po::value<float>(&tolerance)->default_value(0.001f),"relative change of the stopping criterion below which iterations stop")
       ("xy-rez,x", po::value<float>(&xy_res)->default_value(-1.0f), "x/y resolution (um/px)")
       ("kernel-spacing,p", po::value<float>(&kernel_zstep)->default_value(-1.0f),"z-step size of kernel")
       ("image-spacing,q", po::value<float>(&img_zstep)->default_value(-1.0f),"z-step size of input image")
       ("subtract-constant,s", po::value<float>(&subtract_constant)->default_value(0.0f),"constant intensity value to subtract from input image")
-      ("output,o", po::value<std::string>()->required(),"output file path")
+      ("background-image", po::value<std::string>(&background_path)->default_value(""),"camera offset image to subtract from every slice of the input image")
+      ("background-percentile", po::value<float>(&background_percentile)->default_value(-1.0f),"percentile (0-100) of each slice to subtract from it as background")
+      ("output,o", po::value<std::string>()->required(),"output file path ({} is replaced by the input file name)")
+      ("input-list,l", po::value<std::string>(&input_list)->default_value(""),"file listing input paths, one per line")
       ("bit-depth,b", po::value<unsigned int>(&bit_depth)->default_value(16),"bit depth (8, 16, or 32) of output image")
+      ("compression", po::value<std::string>(&compression)->default_value("none"),"lossless compression of output TIFFs (none, lzw, deflate, or zstd)")
       ("thread,t", po::value<unsigned int>(&threadnum)->default_value(1),"number of threads")
+#ifdef LLSM_HAVE_FFTW
+      ("engine", po::value<std::string>(&engine)->default_value("native"),"deconvolution engine (native or itk)")
+#else
+      ("engine", po::value<std::string>(&engine)->default_value("itk"),"deconvolution engine (native or itk)")
+#endif
+      ("pad-mode", po::value<std::string>(&pad_mode_name)->default_value("smooth"),"padded FFT size per axis (minimal, smooth for 2,3,5,7-smooth, or pow2)")
+      ("plan-rigor", po::value<std::string>(&plan_rigor)->default_value("measure"),"FFTW planning rigor (estimate, measure, patient, or exhaustive)")
+      ("wisdom-dir", po::value<std::string>(&wisdom_dir)->default_value(""),"directory of the FFTW wisdom cache shared between runs (disabled if empty)")
+      ("otf-dir", po::value<std::string>(&otf_dir)->default_value(""),"directory of the kernel spectrum (OTF) cache shared between runs (disabled if empty)")
+      ("max-memory,m", po::value<float>(&max_memory)->default_value(0.0f),"memory limit (GB) above which the image is deconvolved in overlapping tiles (0 for no limit)")
+      ("tile-workers", po::value<unsigned int>(&tile_workers)->default_value(1),"number of tiles deconvolved in parallel, sharing the threads")
       ("overwrite,w", po::value<bool>(&overwrite)->default_value(false)->implicit_value(true)->zero_tokens(), "overwrite output if it exists")
       ("verbose,v", po::value<bool>(&verbose)->default_value(false)->implicit_value(true)->zero_tokens(), "display progress and debug information")
       ("version", "display the version number")
@@ -43,11 +84,11 @@ int main(int argc, char** argv) {
 
   po::options_description hidden_opts;
   hidden_opts.add_options()
-    ("input", po::value<std::string>()->required(), "input file path")
+    ("input", po::value<std::vector<std::string>>()->multitoken(), "input file paths or wildcard patterns")
   ;
 
   po::positional_options_description positional_opts; 
-  positional_opts.add("input", 1);
+  positional_opts.add("input", -1);
 
   po::options_description all_opts;
   all_opts.add(visible_opts).add(hidden_opts);
@@ -87,24 +128,58 @@ int main(int argc, char** argv) {
   }
 
   // check files
-  const char* in_path = varsmap["input"].as<std::string>().c_str();
-  if (!IsFile(in_path)) {
-    std::cerr << "decon: input path is not a file" << std::endl;
+  std::vector<std::string> in_paths;
+  if (varsmap.count("input")) {
+    in_paths = ExpandPaths(varsmap["input"].as<std::vector<std::string>>());
+  }
+  if (!input_list.empty()) {
+    if (!IsFile(input_list.c_str())) {
+      std::cerr << "decon: input list path is not a file" << std::endl;
+      return EXIT_FAILURE;
+    }
+    std::vector<std::string> listed = ExpandPaths(ReadPathList(input_list));
+    in_paths.insert(in_paths.end(), listed.begin(), listed.end());
+  }
+  if (in_paths.empty()) {
+    std::cerr << "decon: no input files" << std::endl;
     return EXIT_FAILURE;
   }
+  for (const std::string &in_path : in_paths) {
+    if (!IsFile(in_path.c_str())) {
+      std::cerr << "decon: input path is not a file: " << in_path << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
   const char* kernel_path = varsmap["kernel"].as<std::string>().c_str();
   if (!IsFile(kernel_path)) {
     std::cerr << "decon: kernel path is not a file" << std::endl;
     return EXIT_FAILURE;
   }
-  const char* out_path = varsmap["output"].as<std::string>().c_str();
-  if (IsFile(out_path)) {
-    if (!overwrite) {
-      std::cerr << "decon: output path already exists" << std::endl;
+  const std::string out_pattern = varsmap["output"].as<std::string>();
+  if (in_paths.size() > 1 && out_pattern.find("{}") == std::string::npos) {
+    std::cerr << "decon: output path must contain {} when deconvolving multiple files" << std::endl;
+    return EXIT_FAILURE;
+  }
+  std::vector<std::string> out_paths;
+  std::set<std::string> unique_out_paths;
+  for (const std::string &in_path : in_paths) {
+    std::string out_path = FormatOutputPath(out_pattern, in_path);
+    // inputs with the same stem in different directories would write the same file
+    boost::system::error_code ec;
+    boost::filesystem::path resolved = boost::filesystem::weakly_canonical(out_path, ec);
+    if (!unique_out_paths.insert(ec ? out_path : resolved.string()).second) {
+      std::cerr << "decon: more than one input would be written to " << out_path << std::endl;
       return EXIT_FAILURE;
-    } else if (verbose) {
-        std::cout << "overwriting: " << out_path << std::endl;
     }
+    if (IsFile(out_path.c_str())) {
+      if (!overwrite) {
+        std::cerr << "decon: output path already exists: " << out_path << std::endl;
+        return EXIT_FAILURE;
+      } else if (verbose) {
+          std::cout << "overwriting: " << out_path << std::endl;
+      }
+    }
+    out_paths.push_back(out_path);
   }
 
   // check bit depth
@@ -115,80 +190,344 @@ int main(int argc, char** argv) {
     return EXIT_FAILURE;
   }
 
+  // check compression
+  uint16_t compression_scheme = COMPRESSION_NONE;
+  if (!ParseTiffCompression(compression, compression_scheme)) {
+    std::cerr << "decon: compression must be none, lzw, deflate, or zstd, and supported by the TIFF library" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  // check plan rigor
+  std::string plan_rigor_name = PlanRigorName(plan_rigor);
+  if (plan_rigor_name.empty()) {
+    std::cerr << "decon: plan rigor must be estimate, measure, patient, or exhaustive" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  // check engine, the native engine is required by every option that works on the kernel spectrum
+  if (engine != "native" && engine != "itk") {
+    std::cerr << "decon: engine must be native or itk" << std::endl;
+    return EXIT_FAILURE;
+  }
+#ifndef LLSM_HAVE_FFTW
+  if (engine == "native") {
+    std::cerr << "decon: the native engine requires ITK built with FFTW in the working precision" << std::endl;
+    return EXIT_FAILURE;
+  }
+#endif
+
+  // check background, one kind of background is subtracted while the input is converted
+  Background background;
+  int backgrounds = (subtract_constant != 0.0) + !background_path.empty() + (background_percentile >= 0.0);
+  if (backgrounds > 1) {
+    std::cerr << "decon: only one of subtract constant, background image, or background percentile can be used" << std::endl;
+    return EXIT_FAILURE;
+  }
+  if (subtract_constant != 0.0) {
+    background.mode = BackgroundMode::kConstant;
+    background.constant = subtract_constant;
+  }
+  if (!background_path.empty()) {
+    if (!IsFile(background_path.c_str()) || !ReadBackgroundImage(background_path, background)) {
+      std::cerr << "decon: unable to read background image" << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+  if (background_percentile >= 0.0) {
+    if (background_percentile > 100.0) {
+      std::cerr << "decon: background percentile must be between 0 and 100" << std::endl;
+      return EXIT_FAILURE;
+    }
+    background.mode = BackgroundMode::kPercentile;
+    background.percentile = background_percentile;
+  }
+
+  // check padding
+  PadMode pad_mode;
+  if (!ParsePadMode(pad_mode_name, pad_mode)) {
+    std::cerr << "decon: pad mode must be minimal, smooth, or pow2" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  // check stopping criterion
+  RichardsonLucySettings settings;
+  settings.iterations = iterations;
+  settings.accelerate = accelerate;
+  settings.tolerance = tolerance;
+  if (!ParseStopCriterion(stop, settings.stop)) {
+    std::cerr << "decon: stopping criterion must be none, change, or divergence" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  // check tiling
+  if (max_memory < 0.0 || tile_workers < 1) {
+    std::cerr << "decon: max memory must not be negative and tile workers must be at least 1" << std::endl;
+    return EXIT_FAILURE;
+  }
+  const size_t max_bytes = static_cast<size_t>(max_memory * 1024.0 * 1024.0 * 1024.0);
+
+  if (engine == "itk" && (!otf_dir.empty() || max_bytes > 0 || accelerate || settings.stop != StopCriterion::kNone)) {
+    std::cerr << "decon: OTF caching, tiling, acceleration and stopping criteria require the native engine" << std::endl;
+    return EXIT_FAILURE;
+  }
+
   // print parameters
   if (verbose) {
     std::cout << "\nInput Parameters\n";
     std::cout << "Iterations = " << iterations << "\n";
+    std::cout << "Accelerate = " << accelerate << "\n";
+    std::cout << "Stopping Criterion = " << stop << "\n";
+    std::cout << "Tolerance = " << tolerance << "\n";
     std::cout << "Threads = " << threadnum << "\n";
-    std::cout << "Input Path = " << in_path << "\n";
+    std::cout << "Engine = " << engine << "\n";
+    std::cout << "Precision = " << (sizeof(kPixelType) * 8) << "-bit float\n";
+    for (const std::string &in_path : in_paths)
+      std::cout << "Input Path = " << in_path << "\n";
     std::cout << "Kernel Path = " << kernel_path << "\n";
-    std::cout << "Output Path = " << out_path << "\n";
+    std::cout << "Subtract Constant = " << subtract_constant << "\n";
+    std::cout << "Background Image = " << background_path << "\n";
+    std::cout << "Background Percentile = " << background_percentile << "\n";
+    std::cout << "Pad Mode = " << pad_mode_name << "\n";
+    std::cout << "Plan Rigor = " << plan_rigor << "\n";
+    std::cout << "Wisdom Directory = " << wisdom_dir << "\n";
+    std::cout << "OTF Directory = " << otf_dir << "\n";
+    std::cout << "Max Memory = " << max_memory << " GB\n";
+    std::cout << "Tile Workers = " << tile_workers << "\n";
+    std::cout << "Output Path = " << out_pattern << "\n";
     std::cout << "Overwrite = " << overwrite << "\n";
+    std::cout << "Compression = " << compression << "\n";
     std::cout << "Bit Depth = " << bit_depth << std::endl;
   }
 
   // Start timing
   auto start_time = std::chrono::high_resolution_clock::now();
 
-  // read data
-  kImageType::Pointer img = ReadImageFile<kImageType>(in_path);
-  kImageType::Pointer kernel = ReadImageFile<kImageType>(kernel_path);
-
-  // set spacing
-  kImageType::SpacingType img_spacing = img->GetSpacing();
-  kImageType::SpacingType kernel_spacing = kernel->GetSpacing();
-
+  // kernel spacing and size, the kernel itself is only read when its spectrum is not cached
+  kImageType::SpacingType kernel_spacing;
+  kImageType::SizeType kernel_file_size;
+  if (!ReadImageGeometry<kImageType>(kernel_path, kernel_file_size, kernel_spacing)) {
+    std::cerr << "decon: unable to read kernel" << std::endl;
+    return EXIT_FAILURE;
+  }
   if (xy_res > 0.0) {
-    img_spacing[0] = xy_res;
-    img_spacing[1] = xy_res;
     kernel_spacing[0] = xy_res;
     kernel_spacing[1] = xy_res;
   }
-  if (img_zstep > 0.0)
-    img_spacing[2] = img_zstep;
   if (kernel_zstep > 0.0)
     kernel_spacing[2] = kernel_zstep;
-  
-  img->SetSpacing(img_spacing);
-  kernel->SetSpacing(kernel_spacing);
 
-  // resample kernel
-  if (img_spacing[2] != kernel_spacing[2])
-  {
-    kernel = Resampler(kernel, img_spacing, verbose);
-  }
+  // the native engine shares one kernel spectrum, one set of plans and one set of working
+  // volumes between all files of the same size
+#ifdef LLSM_HAVE_FFTW
+  const bool use_otf = (engine == "native");
+  const unsigned int rigor = itk::FFTWGlobalConfiguration::GetPlanRigorValue(plan_rigor_name);
+  const uint64_t psf_hash = otf_dir.empty() ? 0 : HashFile(kernel_path);
+  std::unique_ptr<OTF> otf = nullptr;
+  std::unique_ptr<RichardsonLucyDeconvolver> deconvolver = nullptr;
+  std::unique_ptr<TiledDeconvolver> tiled_deconvolver = nullptr;
+#endif
 
-  // subtract constant
-  if (subtract_constant != 0.0)
-  {
-    img = SubtractConstantClamped(img, (kPixelType) subtract_constant/std::numeric_limits<unsigned short>::max()); // TODO: scale subtraction by input type
+  // reads an image, subtracting the camera offset while converting it, and sets its spacing
+  auto load_image = [&](const std::string &path) -> kImageType::Pointer {
+    kImageType::Pointer img = ReadImageFileSubtracted<kImageType>(path, background);
+    if (img == nullptr)
+      return nullptr;
 
-  }
+    kImageType::SpacingType img_spacing = img->GetSpacing();
+    if (xy_res > 0.0) {
+      img_spacing[0] = xy_res;
+      img_spacing[1] = xy_res;
+    }
+    if (img_zstep > 0.0)
+      img_spacing[2] = img_zstep;
+    img->SetSpacing(img_spacing);
 
-  // decon
-  kImageType::Pointer decon_img = RichardsonLucy(img, kernel, iterations, verbose);
+    return img;
+  };
 
-  img_spacing[0] = 1.0;
-  img_spacing[1] = 1.0;
-  img_spacing[2] = 1.0;
-  decon_img->SetSpacing(img_spacing);
+  kImageType::Pointer kernel = nullptr;
+  kImageType::SizeType prepared_size;
+  kImageType::SpacingType prepared_spacing;
+  bool prepared = false;
+  bool wisdom_saved = false;
+  std::string wisdom_path = "";
+  int status = EXIT_SUCCESS;
 
-  // write file
-  if (bit_depth == 8) {
-    using PixelTypeOut = unsigned char;
-    using ImageTypeOut = itk::Image<PixelTypeOut, kDimensions>;
-    WriteImageFile<kImageType,ImageTypeOut>(decon_img, out_path);
-  } else if (bit_depth == 16) {
-    using PixelTypeOut = unsigned short;
-    using ImageTypeOut = itk::Image<PixelTypeOut, kDimensions>;
-    WriteImageFile<kImageType,ImageTypeOut>(decon_img, out_path);
-  } else if (bit_depth == 32) {
-    using PixelTypeOut = float;
-    using ImageTypeOut = itk::Image<PixelTypeOut, kDimensions>;
-    WriteImageFile<kImageType,ImageTypeOut>(decon_img, out_path);
-  } else {
-    std::cerr << "decon: unknown bit depth" << std::endl;
-    return EXIT_FAILURE;
+  // reading the next file overlaps with deconvolving the current one
+  std::future<kImageType::Pointer> next_img = std::async(std::launch::async, load_image, in_paths[0]);
+
+  for (size_t n = 0; n < in_paths.size(); ++n) {
+    auto file_start_time = std::chrono::high_resolution_clock::now();
+
+    kImageType::Pointer img = next_img.get();
+    if (n + 1 < in_paths.size())
+      next_img = std::async(std::launch::async, load_image, in_paths[n + 1]);
+
+    if (img == nullptr) {
+      std::cerr << "decon: unable to read " << in_paths[n] << std::endl;
+      status = EXIT_FAILURE;
+      continue;
+    }
+
+    kImageType::SpacingType img_spacing = img->GetSpacing();
+    kImageType::SizeType img_size = img->GetLargestPossibleRegion().GetSize();
+
+    // prepare the kernel whenever the image size or spacing changes
+    if (!prepared || img_size != prepared_size || img_spacing != prepared_spacing) {
+      kImageType::SizeType kernel_size = kernel_file_size;
+      if (img_spacing[2] != kernel_spacing[2])
+      {
+        kernel_size = ResampledSize<kImageType>(kernel_size, kernel_spacing, img_spacing);
+      }
+
+      // split the image into tiles when the whole volume does not fit in memory
+      std::array<size_t, kDimensions> fft_size = {img_size[0], img_size[1], img_size[2]};
+      TileLayout layout = MakeTileLayout(fft_size, {0, 0, 0}, {1, 1, 1});
+      if (max_bytes > 0) {
+        // the next file of a batch is read while this one is deconvolved, holding a copy in
+        // its file type and one in the working precision; budget for the largest of them
+        size_t resident_bytes = 0;
+        for (size_t m = n + 1; m < in_paths.size(); ++m) {
+          size_t file_bytes = 0, converted_bytes = 0;
+          if (ReadImageFootprint<kImageType>(in_paths[m], file_bytes, converted_bytes))
+            resident_bytes = std::max(resident_bytes, file_bytes + converted_bytes);
+        }
+        layout = ComputeTileLayout(fft_size, {kernel_size[0], kernel_size[1], kernel_size[2]}, max_bytes, tile_workers, accelerate, pad_mode, resident_bytes);
+        if (TiledMemory(layout, {kernel_size[0], kernel_size[1], kernel_size[2]}, tile_workers, accelerate, pad_mode, resident_bytes) > max_bytes)
+          std::cerr << "Warning: unable to fit " << in_paths[n] << " in " << max_memory << " GB, using the smallest tiles" << std::endl;
+        fft_size = layout.extent;
+        if (verbose) {
+          std::cout << "Tiles = " << layout.count[0] << "x" << layout.count[1] << "x" << layout.count[2]
+                    << " of " << layout.extent[0] << "x" << layout.extent[1] << "x" << layout.extent[2]
+                    << " with overlap " << layout.margin[0] << "x" << layout.margin[1] << "x" << layout.margin[2] << std::endl;
+        }
+      }
+
+      // load cached FFTW plans for this problem size
+      if (!wisdom_dir.empty()) {
+        std::ostringstream size_key;
+        // the pad mode decides the padded FFT sizes the plans are made for
+        size_key << fft_size[0] << "x" << fft_size[1] << "x" << fft_size[2] << "_k" << kernel_size[0] << "x" << kernel_size[1] << "x" << kernel_size[2]
+                 << "_" << pad_mode_name;
+        wisdom_path = WisdomFilePath(wisdom_dir, size_key.str(), threadnum);
+        wisdom_saved = false;
+        ImportFFTWWisdom(wisdom_path, verbose);
+      }
+
+      // map a cached kernel spectrum for this PSF and image size
+      bool read_kernel = true;
+#ifdef LLSM_HAVE_FFTW
+      PadGeometry geometry = ComputePadGeometry(fft_size, {kernel_size[0], kernel_size[1], kernel_size[2]}, pad_mode);
+      if (verbose) {
+        PadGeometry minimal = ComputePadGeometry(fft_size, {kernel_size[0], kernel_size[1], kernel_size[2]}, PadMode::kMinimal);
+        std::cout << "Padded size = " << geometry.padded[0] << "x" << geometry.padded[1] << "x" << geometry.padded[2]
+                  << " (" << pad_mode_name << ", minimal " << minimal.padded[0] << "x" << minimal.padded[1] << "x" << minimal.padded[2]
+                  << ", greatest prime factors " << GreatestPrimeFactor(geometry.padded[0]) << ", " << GreatestPrimeFactor(geometry.padded[1]) << ", " << GreatestPrimeFactor(geometry.padded[2])
+                  << ", " << 100.0 * (double(geometry.Voxels()) / minimal.Voxels() - 1.0) << "% more voxels than minimal)" << std::endl;
+      }
+      const OTFSpacing otf_kernel_spacing = {kernel_spacing[0], kernel_spacing[1], kernel_spacing[2]};
+      const OTFSpacing otf_image_spacing = {img_spacing[0], img_spacing[1], img_spacing[2]};
+      std::string otf_path = "";
+      otf = nullptr;
+      if (!otf_dir.empty()) {
+        otf_path = OTFCachePath(otf_dir, psf_hash, otf_kernel_spacing, otf_image_spacing, geometry);
+        otf = OTF::Map(otf_path, psf_hash, otf_kernel_spacing, otf_image_spacing, geometry, verbose);
+        read_kernel = (otf == nullptr);
+      }
+#endif
+
+      // read and resample kernel unless its spectrum was cached
+      kernel = nullptr;
+      if (read_kernel)
+      {
+        kernel = ReadImageFile<kImageType>(kernel_path);
+        kernel->SetSpacing(kernel_spacing);
+
+        if (img_spacing[2] != kernel_spacing[2])
+        {
+          kernel = Resampler(kernel, img_spacing, verbose);
+        }
+      }
+
+#ifdef LLSM_HAVE_FFTW
+      if (use_otf) {
+        if (otf == nullptr) {
+          otf = OTF::Compute(kernel->GetBufferPointer(), geometry);
+          if (!otf_path.empty())
+            otf->Save(otf_path, psf_hash, otf_kernel_spacing, otf_image_spacing, verbose);
+          kernel = nullptr;
+        }
+        deconvolver = nullptr;
+        tiled_deconvolver = nullptr;
+        if (layout.Tiles() > 1)
+          tiled_deconvolver.reset(new TiledDeconvolver(layout, geometry, tile_workers, threadnum, rigor, accelerate));
+        else
+          deconvolver.reset(new RichardsonLucyDeconvolver(geometry, threadnum, rigor, accelerate));
+      }
+#endif
+
+      prepared_size = img_size;
+      prepared_spacing = img_spacing;
+      prepared = true;
+    }
+
+    // decon
+    auto decon_start_time = std::chrono::high_resolution_clock::now();
+    kImageType::Pointer decon_img = nullptr;
+    double iterations_run = iterations;
+#ifdef LLSM_HAVE_FFTW
+    if (tiled_deconvolver) {
+      decon_img = RichardsonLucyTiled(img, *otf, *tiled_deconvolver, settings, verbose, &iterations_run);
+    }
+    else if (use_otf) {
+      decon_img = RichardsonLucyOTF(img, *otf, *deconvolver, settings, verbose, &iterations_run);
+    }
+    else
+#endif
+    {
+      decon_img = RichardsonLucy(img, kernel, iterations, verbose, plan_rigor_name);
+    }
+    img = nullptr;
+
+    if (verbose) {
+      auto decon_duration = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - decon_start_time);
+      double voxels = double(img_size[0]) * img_size[1] * img_size[2];
+      std::cout << "Deconvolution took " << decon_duration.count() / 1000.0 << " seconds ("
+                << voxels * iterations_run / std::max<double>(decon_duration.count(), 1.0) / 1000.0 << " million voxel iterations per second)" << std::endl;
+    }
+
+    if (!wisdom_path.empty() && !wisdom_saved) {
+      wisdom_saved = ExportFFTWWisdom(wisdom_path, verbose);
+    }
+
+    img_spacing[0] = 1.0;
+    img_spacing[1] = 1.0;
+    img_spacing[2] = 1.0;
+    decon_img->SetSpacing(img_spacing);
+
+    // write file
+    const std::string &out_path = out_paths[n];
+    if (bit_depth == 8) {
+      using PixelTypeOut = unsigned char;
+      using ImageTypeOut = itk::Image<PixelTypeOut, kDimensions>;
+      WriteImageFile<kImageType,ImageTypeOut>(decon_img, out_path, false, true, true, "", compression_scheme);
+    } else if (bit_depth == 16) {
+      using PixelTypeOut = unsigned short;
+      using ImageTypeOut = itk::Image<PixelTypeOut, kDimensions>;
+      WriteImageFile<kImageType,ImageTypeOut>(decon_img, out_path, false, true, true, "", compression_scheme);
+    } else if (bit_depth == 32) {
+      using PixelTypeOut = float;
+      using ImageTypeOut = itk::Image<PixelTypeOut, kDimensions>;
+      WriteImageFile<kImageType,ImageTypeOut>(decon_img, out_path, false, true, true, "", compression_scheme);
+    } else {
+      std::cerr << "decon: unknown bit depth" << std::endl;
+      return EXIT_FAILURE;
+    }
+
+    if (verbose) {
+      auto file_duration = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - file_start_time);
+      std::cout << "Deconvolved " << in_paths[n] << " -> " << out_path << " in " << file_duration.count() / 1000.0 << " seconds" << std::endl;
+    }
   }
 
   // End timing and display results
@@ -197,7 +536,9 @@ int main(int argc, char** argv) {
   
   std::cout << "\n=== Processing Complete ===\n";
   std::cout << "Threads used: " << threadnum << "\n";
+  std::cout << "Files processed: " << in_paths.size() << "\n";
   std::cout << "Processing time: " << duration.count() / 1000.0 << " seconds" << std::endl;
+  std::cout << "Peak memory: " << PeakMemoryMB() << " MB" << std::endl;
 
-  return EXIT_SUCCESS;
+  return status;
 }
\ No newline at end of file
@@ -10,6 +10,7 @@
 #include <itkZeroFluxNeumannBoundaryCondition.h>
 #include <itkMultiThreaderBase.h>
 #include <iostream>
+#include <string>
 
 // FFTW support for multi-threading
 #if defined(ITK_USE_FFTWF) || defined(ITK_USE_FFTWD)
@@ -35,19 +36,20 @@
 
 // Richardson-Lucy
 // Requires a kernel and a number of iterations.
-kImageType::Pointer RichardsonLucy(kImageType::Pointer img, kImageType::Pointer kernel, unsigned int iterations, bool verbose=false)
+template <class TImage>
+itk::SmartPointer<TImage> RichardsonLucy(itk::SmartPointer<TImage> img, itk::SmartPointer<TImage> kernel, unsigned int iterations, bool verbose=false, const std::string &plan_rigor="FFTW_MEASURE")
 {
-    using DeconFilterType = itk::RichardsonLucyDeconvolutionImageFilter<kImageType>;
-    itk::ZeroFluxNeumannBoundaryCondition< kImageType > bc;
+    using DeconFilterType = itk::RichardsonLucyDeconvolutionImageFilter<TImage>;
+    itk::ZeroFluxNeumannBoundaryCondition< TImage > bc;
 
     // Enable FFTW multi-threading if available
     #if defined(ITK_USE_FFTWF) || defined(ITK_USE_FFTWD)
-        itk::FFTWGlobalConfiguration::SetPlanRigor(FFTW_MEASURE);
+        itk::FFTWGlobalConfiguration::SetPlanRigor(itk::FFTWGlobalConfiguration::GetPlanRigorValue(plan_rigor));
         
         if (verbose) {
             unsigned int num_threads = itk::MultiThreaderBase::GetGlobalDefaultNumberOfThreads();
             std::cout << "FFTW backend detected - attempting multi-threaded deconvolution with " 
-                      << num_threads << " threads" << std::endl;
+                      << num_threads << " threads (" << plan_rigor << ")" << std::endl;
         }
     #else
         if (verbose) {
@@ -56,7 +58,7 @@ kImageType::Pointer RichardsonLucy(kImageType::Pointer img, kImageType::Pointer
         }
     #endif
 
-    DeconFilterType::Pointer filter = DeconFilterType::New();
+    typename DeconFilterType::Pointer filter = DeconFilterType::New();
     filter->SetInput(img);
     filter->SetKernelImage(kernel);
     filter->NormalizeOn();
@@ -71,12 +73,13 @@ kImageType::Pointer RichardsonLucy(kImageType::Pointer img, kImageType::Pointer
 // Projected Landweber (non-negative version of Landweber)
 // Requires a kernel, a number of iterations, and a relaxation parameter alpha. The parameter alpha is positive and less than 2/sigma1^2, where 
 // sigma1 is the largest singular value of the convolution operator.
-kImageType::Pointer ProjectedLandweber(kImageType::Pointer img, kImageType::Pointer kernel, unsigned int iterations, double alpha, bool verbose=false)
+template <class TImage>
+itk::SmartPointer<TImage> ProjectedLandweber(itk::SmartPointer<TImage> img, itk::SmartPointer<TImage> kernel, unsigned int iterations, double alpha, bool verbose=false)
 {
-    using DeconFilterType = itk::ProjectedLandweberDeconvolutionImageFilter<kImageType>;
-    itk::ZeroFluxNeumannBoundaryCondition< kImageType > bc;
+    using DeconFilterType = itk::ProjectedLandweberDeconvolutionImageFilter<TImage>;
+    itk::ZeroFluxNeumannBoundaryCondition< TImage > bc;
 
-    DeconFilterType::Pointer filter = DeconFilterType::New();
+    typename DeconFilterType::Pointer filter = DeconFilterType::New();
     filter->SetInput(img);
     filter->SetKernelImage(kernel);
     filter->NormalizeOn();
@@ -0,0 +1,19 @@
+#pragma once
+
+#include "defines.h"
+#include <complex>
+
+// FFTW can only be called directly when ITK was built with FFTW in the working precision, and
+// the native engine was not turned off with LLSM_NATIVE_DECON=OFF
+#if !defined(LLSM_NO_NATIVE_DECON) && ((defined(ITK_USE_FFTWF) && !defined(LLSM_DOUBLE_PRECISION)) || (defined(ITK_USE_FFTWD) && defined(LLSM_DOUBLE_PRECISION)))
+  #define LLSM_HAVE_FFTW
+  #include <itkFFTWGlobalConfiguration.h>
+  #include "fftw3.h"
+  #ifdef LLSM_DOUBLE_PRECISION
+    #define LLSM_FFTW(name) fftw_##name
+  #else
+    #define LLSM_FFTW(name) fftwf_##name
+  #endif
+#endif
+
+using kComplexType = std::complex<kPixelType>;
@@ -0,0 +1,252 @@
+#pragma once
+
+#include "defines.h"
+#include "fftw.h"
+#include "padding.h"
+#include "utils.h"
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <boost/filesystem.hpp>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// On-disk layout of a cached kernel spectrum: a header followed, at kOTFDataOffset,
+// by the half spectrum of the padded, centered and normalized kernel.
+constexpr char kOTFMagic[8] = {'L', 'L', 'S', 'M', 'O', 'T', 'F', '2'};
+constexpr size_t kOTFDataOffset = 4096;
+
+struct OTFHeader
+{
+    char magic[8];
+    uint32_t pixel_bits;
+    uint32_t dimensions;
+    uint64_t psf_hash;
+    double kernel_spacing[kDimensions];
+    double image_spacing[kDimensions];
+    uint64_t image[kDimensions];
+    uint64_t kernel[kDimensions];
+    uint64_t padded[kDimensions];
+    uint64_t lower[kDimensions];
+};
+
+// Kernel and image spacing (x, y, z) a cached spectrum was computed for
+using OTFSpacing = std::array<double, kDimensions>;
+
+std::string OTFCachePath(const std::string &otf_dir, uint64_t psf_hash, const OTFSpacing &kernel_spacing, const OTFSpacing &image_spacing, const PadGeometry &geometry)
+{
+    std::ostringstream name;
+    name << "otf_" << std::hex << std::setw(16) << std::setfill('0') << psf_hash << std::dec << std::setprecision(6)
+         << "_p" << kernel_spacing[0] << "x" << kernel_spacing[1] << "x" << kernel_spacing[2]
+         << "_q" << image_spacing[0] << "x" << image_spacing[1] << "x" << image_spacing[2]
+         << "_" << geometry.padded[0] << "x" << geometry.padded[1] << "x" << geometry.padded[2]
+         << "_k" << geometry.kernel[0] << "x" << geometry.kernel[1] << "x" << geometry.kernel[2]
+         << "_f" << (sizeof(kPixelType) * 8) << ".otf";
+
+    boost::filesystem::path p(otf_dir);
+    p /= name.str();
+
+    return p.string();
+}
+
+// True if a spacing read from a cache header is usable and matches the expected one
+bool OTFSpacingMatches(const double *cached, const OTFSpacing &expected)
+{
+    for (unsigned int i = 0; i < kDimensions; ++i)
+    {
+        if (!std::isfinite(cached[i]) || cached[i] <= 0.0)
+            return false;
+        if (std::abs(cached[i] - expected[i]) > 1e-6 * std::abs(expected[i]))
+            return false;
+    }
+    return true;
+}
+
+// Optical transfer function: the spectrum of the kernel, zero padded to the FFT size, shifted so
+// its center sits at the origin and normalized to unit sum. The spectrum is pre-scaled by 1/N so a
+// forward and an unnormalized inverse FFT around a multiply by it perform a convolution.
+class OTF
+{
+public:
+    ~OTF()
+    {
+        if (mapping_)
+            munmap(mapping_, mapping_size_);
+    }
+
+    OTF(const OTF &) = delete;
+    OTF &operator=(const OTF &) = delete;
+
+    const kComplexType *Data() const { return data_; }
+    size_t Size() const { return geometry_.SpectrumVoxels(); }
+    const PadGeometry &Geometry() const { return geometry_; }
+    bool IsMapped() const { return mapping_ != nullptr; }
+
+#ifdef LLSM_HAVE_FFTW
+    // Computes the spectrum of a kernel whose pixels are stored x-fastest with size geometry.kernel
+    static std::unique_ptr<OTF> Compute(const kPixelType *kernel, const PadGeometry &geometry)
+    {
+        std::unique_ptr<OTF> otf(new OTF(geometry));
+        otf->spectrum_.resize(geometry.SpectrumVoxels());
+
+        const size_t px = geometry.padded[0], py = geometry.padded[1], pz = geometry.padded[2];
+        const size_t kx = geometry.kernel[0], ky = geometry.kernel[1], kz = geometry.kernel[2];
+
+        kPixelType *padded = static_cast<kPixelType *>(LLSM_FFTW(malloc)(sizeof(kPixelType) * geometry.Voxels()));
+        LLSM_FFTW(plan) plan = LLSM_FFTW(plan_dft_r2c_3d)(pz, py, px, padded, reinterpret_cast<LLSM_FFTW(complex) *>(otf->spectrum_.data()), FFTW_ESTIMATE);
+
+        std::memset(padded, 0, sizeof(kPixelType) * geometry.Voxels());
+
+        double sum = 0.0;
+        for (size_t i = 0; i < kx * ky * kz; ++i)
+            sum += kernel[i];
+        const kPixelType norm = (sum != 0.0) ? static_cast<kPixelType>(1.0 / sum) : kPixelType(1);
+
+        // wrap the kernel around the origin so its center has zero phase
+        for (size_t z = 0; z < kz; ++z)
+        {
+            size_t oz = (z + pz - kz / 2) % pz;
+            for (size_t y = 0; y < ky; ++y)
+            {
+                size_t oy = (y + py - ky / 2) % py;
+                const kPixelType *row = kernel + (z * ky + y) * kx;
+                kPixelType *out = padded + (oz * py + oy) * px;
+                for (size_t x = 0; x < kx; ++x)
+                    out[(x + px - kx / 2) % px] = row[x] * norm;
+            }
+        }
+
+        LLSM_FFTW(execute)(plan);
+        LLSM_FFTW(destroy_plan)(plan);
+        LLSM_FFTW(free)(padded);
+
+        const kPixelType scale = static_cast<kPixelType>(1.0 / geometry.Voxels());
+        for (kComplexType &value : otf->spectrum_)
+            value *= scale;
+
+        otf->data_ = otf->spectrum_.data();
+        return otf;
+    }
+#endif
+
+    // Maps a cached spectrum, returning nullptr if it is missing or does not match the geometry
+    static std::unique_ptr<OTF> Map(const std::string &path, uint64_t psf_hash, const OTFSpacing &kernel_spacing, const OTFSpacing &image_spacing, const PadGeometry &geometry, bool verbose=false)
+    {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            if (verbose)
+                std::cout << "No OTF cached at " << path << std::endl;
+            return nullptr;
+        }
+
+        const size_t expected = kOTFDataOffset + sizeof(kComplexType) * geometry.SpectrumVoxels();
+        struct stat st;
+        if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) != expected)
+        {
+            close(fd);
+            std::cerr << "Warning: ignoring OTF cache with unexpected size " << path << std::endl;
+            return nullptr;
+        }
+
+        void *mapping = mmap(nullptr, expected, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mapping == MAP_FAILED)
+        {
+            std::cerr << "Warning: unable to map OTF cache " << path << std::endl;
+            return nullptr;
+        }
+
+        const OTFHeader *header = static_cast<const OTFHeader *>(mapping);
+        bool valid = std::memcmp(header->magic, kOTFMagic, sizeof(kOTFMagic)) == 0
+                  && header->pixel_bits == sizeof(kPixelType) * 8
+                  && header->dimensions == kDimensions
+                  && header->psf_hash == psf_hash
+                  && OTFSpacingMatches(header->kernel_spacing, kernel_spacing)
+                  && OTFSpacingMatches(header->image_spacing, image_spacing);
+        for (unsigned int i = 0; valid && i < kDimensions; ++i)
+        {
+            valid = header->image[i] == geometry.image[i]
+                 && header->kernel[i] == geometry.kernel[i]
+                 && header->padded[i] == geometry.padded[i]
+                 && header->lower[i] == geometry.lower[i];
+        }
+        if (!valid)
+        {
+            munmap(mapping, expected);
+            std::cerr << "Warning: ignoring OTF cache that does not match the kernel " << path << std::endl;
+            return nullptr;
+        }
+
+        std::unique_ptr<OTF> otf(new OTF(geometry));
+        otf->mapping_ = mapping;
+        otf->mapping_size_ = expected;
+        otf->data_ = reinterpret_cast<const kComplexType *>(static_cast<const char *>(mapping) + kOTFDataOffset);
+
+        if (verbose)
+            std::cout << "Mapped OTF from " << path << std::endl;
+
+        return otf;
+    }
+
+    // Writes the spectrum to the cache. The file is renamed into place so concurrent jobs
+    // never map a partially written spectrum.
+    bool Save(const std::string &path, uint64_t psf_hash, const OTFSpacing &kernel_spacing, const OTFSpacing &image_spacing, bool verbose=false) const
+    {
+        boost::system::error_code ec;
+        boost::filesystem::create_directories(boost::filesystem::path(path).parent_path(), ec);
+
+        OTFHeader header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, kOTFMagic, sizeof(kOTFMagic));
+        header.pixel_bits = sizeof(kPixelType) * 8;
+        header.dimensions = kDimensions;
+        header.psf_hash = psf_hash;
+        for (unsigned int i = 0; i < kDimensions; ++i)
+        {
+            header.kernel_spacing[i] = kernel_spacing[i];
+            header.image_spacing[i] = image_spacing[i];
+            header.image[i] = geometry_.image[i];
+            header.kernel[i] = geometry_.kernel[i];
+            header.padded[i] = geometry_.padded[i];
+            header.lower[i] = geometry_.lower[i];
+        }
+
+        std::string tmp_path = path + ".tmp." + std::to_string(getpid());
+        std::ofstream file(tmp_path, std::ios::binary);
+        std::vector<char> block(kOTFDataOffset, 0);
+        std::memcpy(block.data(), &header, sizeof(header));
+        file.write(block.data(), block.size());
+        file.write(reinterpret_cast<const char *>(data_), sizeof(kComplexType) * Size());
+        file.close();
+
+        bool saved = file.good() && std::rename(tmp_path.c_str(), path.c_str()) == 0;
+        if (!saved)
+            std::remove(tmp_path.c_str());
+
+        if (verbose)
+            std::cout << (saved ? "Saved OTF to " : "Failed to save OTF to ") << path << std::endl;
+
+        return saved;
+    }
+
+private:
+    explicit OTF(const PadGeometry &geometry) : geometry_(geometry) {}
+
+    PadGeometry geometry_;
+    std::vector<kComplexType> spectrum_;
+    const kComplexType *data_ = nullptr;
+    void *mapping_ = nullptr;
+    size_t mapping_size_ = 0;
+};
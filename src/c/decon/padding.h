@@ -0,0 +1,96 @@
+#pragma once
+
+#include "defines.h"
+#include <array>
+#include <cstddef>
+#include <string>
+
+// Size of the FFT volume used to deconvolve an image and where the image sits inside it.
+// Sizes are ordered x, y, z with x varying fastest in memory.
+struct PadGeometry
+{
+    std::array<size_t, kDimensions> image;
+    std::array<size_t, kDimensions> kernel;
+    std::array<size_t, kDimensions> padded;
+    std::array<size_t, kDimensions> lower; // offset of the image within the padded volume
+
+    size_t Voxels() const { return padded[0] * padded[1] * padded[2]; }
+
+    // number of complex values in the half spectrum of a real-to-complex transform
+    size_t SpectrumVoxels() const { return (padded[0] / 2 + 1) * padded[1] * padded[2]; }
+};
+
+size_t GreatestPrimeFactor(size_t n)
+{
+    size_t factor = 1;
+    for (size_t p = 2; p * p <= n; ++p)
+    {
+        while (n % p == 0)
+        {
+            factor = p;
+            n /= p;
+        }
+    }
+    return (n > 1) ? n : factor;
+}
+
+// How far each padded axis is grown beyond the image plus kernel extent the boundary
+// condition needs. FFTW is fastest on sizes with only small prime factors.
+enum class PadMode
+{
+    kMinimal, // exactly the image plus kernel extent
+    kSmooth,  // the smallest size whose prime factors are all 2, 3, 5 or 7
+    kPow2     // the smallest power of two
+};
+
+// Maps a --pad-mode value (minimal, smooth, or pow2), returning false on an unknown value
+bool ParsePadMode(const std::string &name, PadMode &mode)
+{
+    if (name == "minimal")
+        mode = PadMode::kMinimal;
+    else if (name == "smooth")
+        mode = PadMode::kSmooth;
+    else if (name == "pow2")
+        mode = PadMode::kPow2;
+    else
+        return false;
+
+    return true;
+}
+
+size_t PaddedSize(size_t size, PadMode mode)
+{
+    if (mode == PadMode::kPow2)
+    {
+        size_t padded = 1;
+        while (padded < size)
+            padded *= 2;
+        return padded;
+    }
+
+    if (mode == PadMode::kSmooth)
+    {
+        while (GreatestPrimeFactor(size) > 7)
+            ++size;
+    }
+
+    return size;
+}
+
+// Pads each axis by the kernel extent, then grows it to a size that is fast for the FFT
+PadGeometry ComputePadGeometry(const std::array<size_t, kDimensions> &image, const std::array<size_t, kDimensions> &kernel, PadMode mode=PadMode::kSmooth)
+{
+    PadGeometry geometry;
+    geometry.image = image;
+    geometry.kernel = kernel;
+
+    for (unsigned int i = 0; i < kDimensions; ++i)
+    {
+        size_t size = PaddedSize(image[i] + kernel[i], mode);
+
+        geometry.padded[i] = size;
+        geometry.lower[i] = (size - image[i]) / 2;
+    }
+
+    return geometry;
+}
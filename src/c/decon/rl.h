@@ -0,0 +1,383 @@
+#pragma once
+
+#include "defines.h"
+#include "fftw.h"
+#include "padding.h"
+#include "otf.h"
+#include "parallel.h"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <iostream>
+#include <string>
+#include <itkImage.h>
+
+// Quantity that stops Richardson-Lucy before the maximum number of iterations once its
+// relative change between iterations falls below a tolerance
+enum class StopCriterion
+{
+    kNone,
+    kChange,    // change of the estimate relative to its norm
+    kDivergence // I-divergence between the observed image and the blurred estimate
+};
+
+// Maps a --stop value (none, change, or divergence), returning false on an unknown value
+bool ParseStopCriterion(const std::string &name, StopCriterion &criterion)
+{
+    if (name == "none")
+        criterion = StopCriterion::kNone;
+    else if (name == "change")
+        criterion = StopCriterion::kChange;
+    else if (name == "divergence")
+        criterion = StopCriterion::kDivergence;
+    else
+        return false;
+
+    return true;
+}
+
+struct RichardsonLucySettings
+{
+    unsigned int iterations = 0; // maximum number of iterations
+    bool accelerate = false;     // Biggs-Andrews vector extrapolation
+    StopCriterion stop = StopCriterion::kNone;
+    double tolerance = 0.0;
+};
+
+#ifdef LLSM_HAVE_FFTW
+
+// Richardson-Lucy deconvolution on FFTW real-to-complex transforms with a precomputed OTF.
+// The image is padded with zero-flux Neumann boundaries exactly like the ITK filter, and the
+// padded buffers and FFT plans are allocated once and reused for every iteration.
+//
+// With acceleration, each Richardson-Lucy step starts from a point extrapolated along the
+// last update (Biggs and Andrews, Applied Optics 36, 1997), which typically reaches the same
+// result in about half the iterations at the cost of two more padded volumes.
+class RichardsonLucyDeconvolver
+{
+public:
+    RichardsonLucyDeconvolver(const PadGeometry &geometry, unsigned int threads, unsigned int plan_rigor, bool accelerate=false)
+        : geometry_(geometry), threads_(std::max(1u, threads))
+    {
+        const size_t voxels = geometry_.Voxels();
+        observed_ = static_cast<kPixelType *>(LLSM_FFTW(malloc)(sizeof(kPixelType) * voxels));
+        estimate_ = static_cast<kPixelType *>(LLSM_FFTW(malloc)(sizeof(kPixelType) * voxels));
+        work_ = static_cast<kPixelType *>(LLSM_FFTW(malloc)(sizeof(kPixelType) * voxels));
+        spectrum_ = static_cast<LLSM_FFTW(complex) *>(LLSM_FFTW(malloc)(sizeof(LLSM_FFTW(complex)) * geometry_.SpectrumVoxels()));
+        if (accelerate)
+        {
+            previous_ = static_cast<kPixelType *>(LLSM_FFTW(malloc)(sizeof(kPixelType) * voxels));
+            step_ = static_cast<kPixelType *>(LLSM_FFTW(malloc)(sizeof(kPixelType) * voxels));
+        }
+
+        LLSM_FFTW(init_threads)();
+        LLSM_FFTW(plan_with_nthreads)(threads_);
+
+        // plan before filling the buffers since measuring overwrites them
+        const int px = geometry_.padded[0], py = geometry_.padded[1], pz = geometry_.padded[2];
+        forward_ = LLSM_FFTW(plan_dft_r2c_3d)(pz, py, px, work_, spectrum_, plan_rigor);
+        inverse_ = LLSM_FFTW(plan_dft_c2r_3d)(pz, py, px, spectrum_, work_, plan_rigor);
+    }
+
+    ~RichardsonLucyDeconvolver()
+    {
+        LLSM_FFTW(destroy_plan)(forward_);
+        LLSM_FFTW(destroy_plan)(inverse_);
+        LLSM_FFTW(free)(observed_);
+        LLSM_FFTW(free)(estimate_);
+        LLSM_FFTW(free)(work_);
+        LLSM_FFTW(free)(spectrum_);
+        if (previous_)
+            LLSM_FFTW(free)(previous_);
+        if (step_)
+            LLSM_FFTW(free)(step_);
+    }
+
+    RichardsonLucyDeconvolver(const RichardsonLucyDeconvolver &) = delete;
+    RichardsonLucyDeconvolver &operator=(const RichardsonLucyDeconvolver &) = delete;
+
+    bool IsAccelerated() const { return previous_ != nullptr; }
+
+    // Deconvolves an x-fastest image of size geometry.image into output of the same size and
+    // returns the number of iterations run. Acceleration requires an accelerated deconvolver.
+    unsigned int Deconvolve(const kPixelType *image, kPixelType *output, const kComplexType *otf, const RichardsonLucySettings &settings, bool verbose=false)
+    {
+        const size_t voxels = geometry_.Voxels();
+        const bool accelerate = settings.accelerate && IsAccelerated();
+        const bool divergence = verbose || settings.stop == StopCriterion::kDivergence;
+
+        Pad(image, observed_);
+        const double observed_sum = ParallelSums<1>(voxels, threads_, [&](size_t begin, size_t end, std::array<double, 1> &sums) {
+            double sum = 0.0;
+            for (size_t i = begin; i < end; ++i)
+            {
+                estimate_[i] = observed_[i];
+                sum += observed_[i];
+            }
+            if (accelerate)
+            {
+                std::copy(observed_ + begin, observed_ + end, previous_ + begin);
+                std::fill(step_ + begin, step_ + end, kPixelType(0));
+            }
+            sums[0] += sum;
+        })[0];
+
+        double last_divergence = 0.0;
+        unsigned int n = 0;
+        while (n < settings.iterations)
+        {
+            // blur the current estimate with the kernel
+            LLSM_FFTW(execute_dft_r2c)(forward_, estimate_, spectrum_);
+            Multiply(otf, false);
+            LLSM_FFTW(execute)(inverse_);
+
+            // ratio of the observed image to the blurred estimate, and the I-divergence between them
+            double i_divergence = Ratio(divergence) / observed_sum;
+
+            // correlate the ratio with the kernel
+            LLSM_FFTW(execute)(forward_);
+            Multiply(otf, true);
+            LLSM_FFTW(execute)(inverse_);
+
+            // update the estimate
+            double change = 0.0, norm = 0.0, alpha = 0.0;
+            if (accelerate)
+                alpha = Extrapolate(change, norm);
+            else
+                Update(change, norm);
+            change = (norm > 0.0) ? std::sqrt(change / norm) : 0.0;
+            ++n;
+
+            if (verbose)
+            {
+                std::cout << "Richardson-Lucy iteration " << n << "/" << settings.iterations
+                          << ": change = " << change << ", I-divergence = " << i_divergence;
+                if (accelerate)
+                    std::cout << ", acceleration = " << alpha;
+                std::cout << std::endl;
+            }
+
+            if (settings.stop == StopCriterion::kChange && change < settings.tolerance)
+                break;
+            if (settings.stop == StopCriterion::kDivergence && n > 1 && std::abs(last_divergence - i_divergence) < settings.tolerance * i_divergence)
+                break;
+            last_divergence = i_divergence;
+        }
+
+        if (verbose && n < settings.iterations)
+            std::cout << "Richardson-Lucy converged after " << n << " iterations" << std::endl;
+
+        // the accelerated result is the last Richardson-Lucy step, not the extrapolated point
+        Crop(accelerate ? previous_ : estimate_, output);
+
+        return n;
+    }
+
+private:
+    // Replaces the blurred estimate in work_ by the ratio of the observed image to it and
+    // returns the unnormalized I-divergence between the two if requested
+    double Ratio(bool divergence)
+    {
+        return ParallelSums<1>(geometry_.Voxels(), threads_, [&](size_t begin, size_t end, std::array<double, 1> &sums) {
+            kPixelType *work = work_;
+            const kPixelType *observed = observed_;
+
+            if (!divergence)
+            {
+                for (size_t i = begin; i < end; ++i)
+                    work[i] = (std::abs(work[i]) < EPSILON) ? kPixelType(0) : observed[i] / work[i];
+                return;
+            }
+
+            double sum = 0.0;
+            for (size_t i = begin; i < end; ++i)
+            {
+                const kPixelType blurred = work[i];
+                const kPixelType ratio = (std::abs(blurred) < EPSILON) ? kPixelType(0) : observed[i] / blurred;
+                if (ratio > kPixelType(0))
+                    sum += observed[i] * std::log(double(ratio)) - observed[i] + blurred;
+                work[i] = ratio;
+            }
+            sums[0] += sum;
+        })[0];
+    }
+
+    // Multiplies the estimate by the correlated ratio in work_, accumulating the squared change
+    // and the squared norm of the previous estimate
+    void Update(double &change, double &norm)
+    {
+        std::array<double, 2> sums = ParallelSums<2>(geometry_.Voxels(), threads_, [&](size_t begin, size_t end, std::array<double, 2> &sums) {
+            kPixelType *estimate = estimate_;
+            const kPixelType *work = work_;
+
+            double c = 0.0, e = 0.0;
+            for (size_t i = begin; i < end; ++i)
+            {
+                const kPixelType previous = estimate[i];
+                const kPixelType updated = previous * work[i];
+                c += double(updated - previous) * (updated - previous);
+                e += double(previous) * previous;
+                estimate[i] = updated;
+            }
+            sums[0] += c;
+            sums[1] += e;
+        });
+
+        change += sums[0];
+        norm += sums[1];
+    }
+
+    // Takes the Richardson-Lucy step from the extrapolated point in estimate_ using the correlated
+    // ratio in work_, then extrapolates the next point along the change from the previous step.
+    // Accumulates the squared change of the unextrapolated estimate and the squared norm of the
+    // previous one, and returns the acceleration factor.
+    double Extrapolate(double &change, double &norm)
+    {
+        const size_t voxels = geometry_.Voxels();
+
+        // the new step direction is stored in work_ while the last one is still needed
+        std::array<double, 2> steps = ParallelSums<2>(voxels, threads_, [&](size_t begin, size_t end, std::array<double, 2> &sums) {
+            kPixelType *estimate = estimate_;
+            kPixelType *work = work_;
+            const kPixelType *last_step = step_;
+
+            double product = 0.0, last_norm = 0.0;
+            for (size_t i = begin; i < end; ++i)
+            {
+                const kPixelType updated = estimate[i] * work[i];
+                const kPixelType step = updated - estimate[i];
+                product += double(step) * last_step[i];
+                last_norm += double(last_step[i]) * last_step[i];
+                estimate[i] = updated;
+                work[i] = step;
+            }
+            sums[0] += product;
+            sums[1] += last_norm;
+        });
+
+        double alpha = (steps[1] > 0.0) ? steps[0] / steps[1] : 0.0;
+        alpha = std::min(std::max(alpha, 0.0), 1.0 - EPSILON);
+        const kPixelType a = static_cast<kPixelType>(alpha);
+
+        std::array<double, 2> sums = ParallelSums<2>(voxels, threads_, [&](size_t begin, size_t end, std::array<double, 2> &sums) {
+            kPixelType *estimate = estimate_;
+            kPixelType *previous = previous_;
+            kPixelType *last_step = step_;
+            const kPixelType *work = work_;
+
+            double c = 0.0, e = 0.0;
+            for (size_t i = begin; i < end; ++i)
+            {
+                const kPixelType updated = estimate[i];
+                const kPixelType difference = updated - previous[i];
+                c += double(difference) * difference;
+                e += double(previous[i]) * previous[i];
+                previous[i] = updated;
+                last_step[i] = work[i];
+                estimate[i] = std::max(updated + a * difference, kPixelType(0));
+            }
+            sums[0] += c;
+            sums[1] += e;
+        });
+
+        change += sums[0];
+        norm += sums[1];
+        return alpha;
+    }
+
+    // Multiplies the spectrum by the OTF or its conjugate. The complex product is written out
+    // on interleaved real and imaginary parts so the loop vectorizes.
+    void Multiply(const kComplexType *otf, bool conjugate)
+    {
+        const kPixelType sign = conjugate ? kPixelType(-1) : kPixelType(1);
+
+        ParallelFor(geometry_.SpectrumVoxels(), threads_, [&](size_t begin, size_t end) {
+            kPixelType *spectrum = reinterpret_cast<kPixelType *>(spectrum_);
+            const kPixelType *transfer = reinterpret_cast<const kPixelType *>(otf);
+
+            for (size_t i = begin; i < end; ++i)
+            {
+                const kPixelType a = spectrum[2 * i], b = spectrum[2 * i + 1];
+                const kPixelType c = transfer[2 * i], d = sign * transfer[2 * i + 1];
+                spectrum[2 * i] = a * c - b * d;
+                spectrum[2 * i + 1] = a * d + b * c;
+            }
+        });
+    }
+
+    // zero-flux Neumann padding: samples outside the image repeat the nearest edge voxel
+    void Pad(const kPixelType *image, kPixelType *padded) const
+    {
+        const size_t ix = geometry_.image[0], iy = geometry_.image[1], iz = geometry_.image[2];
+        const size_t px = geometry_.padded[0], py = geometry_.padded[1], pz = geometry_.padded[2];
+
+        auto clamp = [](size_t p, size_t lower, size_t size) -> size_t {
+            return (p < lower) ? 0 : std::min(p - lower, size - 1);
+        };
+
+        ParallelFor(pz, threads_, [&](size_t begin, size_t end) {
+            for (size_t z = begin; z < end; ++z)
+            {
+                size_t sz = clamp(z, geometry_.lower[2], iz);
+                for (size_t y = 0; y < py; ++y)
+                {
+                    size_t sy = clamp(y, geometry_.lower[1], iy);
+                    const kPixelType *row = image + (sz * iy + sy) * ix;
+                    kPixelType *out = padded + (z * py + y) * px;
+                    for (size_t x = 0; x < px; ++x)
+                        out[x] = row[clamp(x, geometry_.lower[0], ix)];
+                }
+            }
+        }, 1);
+    }
+
+    void Crop(const kPixelType *padded, kPixelType *image) const
+    {
+        const size_t ix = geometry_.image[0], iy = geometry_.image[1], iz = geometry_.image[2];
+        const size_t px = geometry_.padded[0], py = geometry_.padded[1];
+
+        ParallelFor(iz, threads_, [&](size_t begin, size_t end) {
+            for (size_t z = begin; z < end; ++z)
+            {
+                for (size_t y = 0; y < iy; ++y)
+                {
+                    const kPixelType *row = padded + ((z + geometry_.lower[2]) * py + y + geometry_.lower[1]) * px + geometry_.lower[0];
+                    std::copy(row, row + ix, image + (z * iy + y) * ix);
+                }
+            }
+        }, 1);
+    }
+
+    PadGeometry geometry_;
+    unsigned int threads_ = 1;
+    kPixelType *observed_ = nullptr;
+    kPixelType *estimate_ = nullptr;
+    kPixelType *work_ = nullptr;
+    kPixelType *previous_ = nullptr; // last Richardson-Lucy estimate, when accelerated
+    kPixelType *step_ = nullptr;     // last Richardson-Lucy step, when accelerated
+    LLSM_FFTW(complex) *spectrum_ = nullptr;
+    LLSM_FFTW(plan) forward_;
+    LLSM_FFTW(plan) inverse_;
+};
+
+// Richardson-Lucy with a precomputed OTF. The deconvolver must have been created for the
+// geometry of the OTF and can be reused for every image of that size. iterations_run receives
+// the number of iterations run, which is lower than the maximum when a stopping criterion is met.
+template <class TImage>
+itk::SmartPointer<TImage> RichardsonLucyOTF(itk::SmartPointer<TImage> img, const OTF &otf, RichardsonLucyDeconvolver &deconvolver, const RichardsonLucySettings &settings, bool verbose=false, double *iterations_run=nullptr)
+{
+    itk::SmartPointer<TImage> output = TImage::New();
+    output->SetRegions(img->GetLargestPossibleRegion());
+    output->SetSpacing(img->GetSpacing());
+    output->SetOrigin(img->GetOrigin());
+    output->SetDirection(img->GetDirection());
+    output->Allocate();
+
+    const unsigned int iterations = deconvolver.Deconvolve(img->GetBufferPointer(), output->GetBufferPointer(), otf.Data(), settings, verbose);
+    if (iterations_run != nullptr)
+        *iterations_run = iterations;
+
+    return output;
+}
+
+#endif
@@ -0,0 +1,266 @@
+#pragma once
+
+#include "defines.h"
+#include "fftw.h"
+#include "padding.h"
+#include "otf.h"
+#include "rl.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <itkImage.h>
+
+// Grid of equally sized, overlapping tiles covering an image. Each tile is a core region
+// extended by a margin on every side; tiles at the image border are shifted inward so
+// that all tiles share one FFT size, one kernel spectrum and one set of plans.
+struct TileLayout
+{
+    std::array<size_t, kDimensions> image;
+    std::array<size_t, kDimensions> count;  // tiles along each axis
+    std::array<size_t, kDimensions> core;   // nominal core size along each axis
+    std::array<size_t, kDimensions> margin; // overlap added on each side of the core
+    std::array<size_t, kDimensions> extent; // size of every tile
+
+    size_t Tiles() const { return count[0] * count[1] * count[2]; }
+
+    size_t TileVoxels() const { return extent[0] * extent[1] * extent[2]; }
+
+    // first voxel of tile k along axis i
+    size_t Start(unsigned int i, size_t k) const
+    {
+        size_t core_start = k * core[i];
+        size_t start = (core_start > margin[i]) ? core_start - margin[i] : 0;
+        return std::min(start, image[i] - extent[i]);
+    }
+};
+
+TileLayout MakeTileLayout(const std::array<size_t, kDimensions> &image, const std::array<size_t, kDimensions> &margin, const std::array<size_t, kDimensions> &count)
+{
+    TileLayout layout;
+    layout.image = image;
+    layout.margin = margin;
+
+    for (unsigned int i = 0; i < kDimensions; ++i)
+    {
+        layout.core[i] = (image[i] + count[i] - 1) / count[i];
+        layout.count[i] = (image[i] + layout.core[i] - 1) / layout.core[i];
+        layout.extent[i] = (layout.count[i] == 1) ? image[i] : std::min(layout.core[i] + 2 * margin[i], image[i]);
+    }
+
+    return layout;
+}
+
+// Bytes needed to deconvolve with a tile layout: the whole input and output volumes, one
+// shared kernel spectrum, per worker the padded FFT buffers plus a tile in and out, and
+// resident_bytes held by the caller at the same time, such as the next file of a batch.
+size_t TiledMemory(const TileLayout &layout, const std::array<size_t, kDimensions> &kernel, unsigned int workers, bool accelerate=false, PadMode pad_mode=PadMode::kSmooth, size_t resident_bytes=0)
+{
+    PadGeometry geometry = ComputePadGeometry(layout.extent, kernel, pad_mode);
+    size_t volume = layout.image[0] * layout.image[1] * layout.image[2];
+    size_t per_worker = (accelerate ? 5 : 3) * geometry.Voxels() + 2 * geometry.SpectrumVoxels() + 2 * layout.TileVoxels();
+
+    return sizeof(kPixelType) * (2 * volume + 2 * geometry.SpectrumVoxels() + workers * per_worker) + resident_bytes;
+}
+
+// Splits the image into the fewest tiles that fit in max_bytes. The overlap between tiles is
+// the kernel extent so every voxel kept from a tile is at least half a kernel from its edge.
+TileLayout ComputeTileLayout(const std::array<size_t, kDimensions> &image, const std::array<size_t, kDimensions> &kernel, size_t max_bytes, unsigned int workers, bool accelerate=false, PadMode pad_mode=PadMode::kSmooth, size_t resident_bytes=0)
+{
+    std::array<size_t, kDimensions> margin;
+    std::array<size_t, kDimensions> count;
+    for (unsigned int i = 0; i < kDimensions; ++i)
+    {
+        margin[i] = std::min(kernel[i], image[i]);
+        count[i] = 1;
+    }
+
+    TileLayout layout = MakeTileLayout(image, margin, count);
+    while (TiledMemory(layout, kernel, workers, accelerate, pad_mode, resident_bytes) > max_bytes)
+    {
+        // split the axis with the largest tiles, as long as cores stay wider than the overlap
+        int axis = -1;
+        for (unsigned int i = 0; i < kDimensions; ++i)
+        {
+            if (layout.core[i] > 2 * margin[i] && (axis < 0 || layout.extent[i] > layout.extent[axis]))
+                axis = i;
+        }
+        if (axis < 0)
+            break;
+
+        count[axis] = layout.count[axis] + 1;
+        layout = MakeTileLayout(image, margin, count);
+    }
+
+    return layout;
+}
+
+#ifdef LLSM_HAVE_FFTW
+
+// Deconvolves an image tile by tile and blends the tiles back together. Within the overlap of
+// two neighbouring tiles their weights ramp linearly in opposite directions and sum to one, so
+// the blend needs no normalization volume.
+class TiledDeconvolver
+{
+public:
+    TiledDeconvolver(const TileLayout &layout, const PadGeometry &geometry, unsigned int workers, unsigned int threads, unsigned int plan_rigor, bool accelerate=false)
+        : layout_(layout)
+    {
+        workers = std::max(1u, std::min<unsigned int>(workers, layout_.Tiles()));
+        const unsigned int threads_per_worker = std::max(1u, threads / workers);
+
+        // FFTW planning is not thread safe, so every worker is planned here
+        for (unsigned int w = 0; w < workers; ++w)
+        {
+            deconvolvers_.emplace_back(new RichardsonLucyDeconvolver(geometry, threads_per_worker, plan_rigor, accelerate));
+            tile_in_.emplace_back(layout_.TileVoxels());
+            tile_out_.emplace_back(layout_.TileVoxels());
+        }
+
+        for (unsigned int i = 0; i < kDimensions; ++i)
+        {
+            weights_[i].resize(layout_.count[i]);
+            for (size_t k = 0; k < layout_.count[i]; ++k)
+                weights_[i][k] = BlendWeights(i, k);
+        }
+    }
+
+    const TileLayout &Layout() const { return layout_; }
+
+    // Tiles stop independently when the settings have a stopping criterion, so this returns
+    // the mean number of iterations run per tile
+    double Deconvolve(const kPixelType *image, kPixelType *output, const kComplexType *otf, const RichardsonLucySettings &settings, bool verbose=false)
+    {
+        std::fill(output, output + layout_.image[0] * layout_.image[1] * layout_.image[2], kPixelType(0));
+
+        std::atomic<size_t> next_tile(0);
+        std::mutex output_mutex;
+        size_t done = 0;
+        size_t total_iterations = 0;
+
+        auto worker = [&](unsigned int w) {
+            for (size_t tile = next_tile++; tile < layout_.Tiles(); tile = next_tile++)
+            {
+                std::array<size_t, kDimensions> k = {tile % layout_.count[0], (tile / layout_.count[0]) % layout_.count[1], tile / (layout_.count[0] * layout_.count[1])};
+                std::array<size_t, kDimensions> start = {layout_.Start(0, k[0]), layout_.Start(1, k[1]), layout_.Start(2, k[2])};
+
+                Extract(image, start, tile_in_[w].data());
+                unsigned int iterations = deconvolvers_[w]->Deconvolve(tile_in_[w].data(), tile_out_[w].data(), otf, settings);
+
+                std::lock_guard<std::mutex> lock(output_mutex);
+                Blend(tile_out_[w].data(), start, k, output);
+                total_iterations += iterations;
+                if (verbose)
+                    std::cout << "Deconvolved tile " << ++done << "/" << layout_.Tiles() << " in " << iterations << " iterations" << std::endl;
+            }
+        };
+
+        std::vector<std::thread> threads;
+        for (unsigned int w = 1; w < deconvolvers_.size(); ++w)
+            threads.emplace_back(worker, w);
+        worker(0);
+        for (std::thread &thread : threads)
+            thread.join();
+
+        return double(total_iterations) / layout_.Tiles();
+    }
+
+private:
+    // weight of tile k along axis i for each voxel of its extent
+    std::vector<float> BlendWeights(unsigned int i, size_t k) const
+    {
+        const size_t start = layout_.Start(i, k);
+        const float half = 0.5f * layout_.margin[i]; // half width of the blend zone
+
+        auto ramp = [half](float p, float boundary) -> float {
+            if (half <= 0.0f)
+                return (p >= boundary) ? 1.0f : 0.0f;
+            return std::min(1.0f, std::max(0.0f, (p - (boundary - half)) / (2.0f * half)));
+        };
+
+        std::vector<float> weights(layout_.extent[i]);
+        for (size_t p = 0; p < layout_.extent[i]; ++p)
+        {
+            float position = start + p + 0.5f;
+            float weight = 1.0f;
+            if (k > 0)
+                weight *= ramp(position, float(k * layout_.core[i]));
+            if (k + 1 < layout_.count[i])
+                weight *= 1.0f - ramp(position, float((k + 1) * layout_.core[i]));
+            weights[p] = weight;
+        }
+
+        return weights;
+    }
+
+    void Extract(const kPixelType *image, const std::array<size_t, kDimensions> &start, kPixelType *tile) const
+    {
+        const size_t ix = layout_.image[0], iy = layout_.image[1];
+        const size_t tx = layout_.extent[0], ty = layout_.extent[1], tz = layout_.extent[2];
+
+        for (size_t z = 0; z < tz; ++z)
+        {
+            for (size_t y = 0; y < ty; ++y)
+            {
+                const kPixelType *row = image + ((start[2] + z) * iy + start[1] + y) * ix + start[0];
+                std::copy(row, row + tx, tile + (z * ty + y) * tx);
+            }
+        }
+    }
+
+    void Blend(const kPixelType *tile, const std::array<size_t, kDimensions> &start, const std::array<size_t, kDimensions> &k, kPixelType *output) const
+    {
+        const size_t ix = layout_.image[0], iy = layout_.image[1];
+        const size_t tx = layout_.extent[0], ty = layout_.extent[1], tz = layout_.extent[2];
+        const std::vector<float> &wx = weights_[0][k[0]];
+        const std::vector<float> &wy = weights_[1][k[1]];
+        const std::vector<float> &wz = weights_[2][k[2]];
+
+        for (size_t z = 0; z < tz; ++z)
+        {
+            for (size_t y = 0; y < ty; ++y)
+            {
+                const float wzy = wz[z] * wy[y];
+                if (wzy == 0.0f)
+                    continue;
+
+                const kPixelType *in = tile + (z * ty + y) * tx;
+                kPixelType *out = output + ((start[2] + z) * iy + start[1] + y) * ix + start[0];
+                for (size_t x = 0; x < tx; ++x)
+                    out[x] += wzy * wx[x] * in[x];
+            }
+        }
+    }
+
+    TileLayout layout_;
+    std::vector<std::unique_ptr<RichardsonLucyDeconvolver>> deconvolvers_;
+    std::vector<std::vector<kPixelType>> tile_in_;
+    std::vector<std::vector<kPixelType>> tile_out_;
+    std::array<std::vector<std::vector<float>>, kDimensions> weights_;
+};
+
+// Blocked Richardson-Lucy. The OTF must have been computed for the padded tile geometry.
+// iterations_run receives the mean number of iterations run per tile.
+template <class TImage>
+itk::SmartPointer<TImage> RichardsonLucyTiled(itk::SmartPointer<TImage> img, const OTF &otf, TiledDeconvolver &deconvolver, const RichardsonLucySettings &settings, bool verbose=false, double *iterations_run=nullptr)
+{
+    itk::SmartPointer<TImage> output = TImage::New();
+    output->SetRegions(img->GetLargestPossibleRegion());
+    output->SetSpacing(img->GetSpacing());
+    output->SetOrigin(img->GetOrigin());
+    output->SetDirection(img->GetDirection());
+    output->Allocate();
+
+    const double iterations = deconvolver.Deconvolve(img->GetBufferPointer(), output->GetBufferPointer(), otf.Data(), settings, verbose);
+    if (iterations_run != nullptr)
+        *iterations_run = iterations;
+
+    return output;
+}
+
+#endif
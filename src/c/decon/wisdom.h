@@ -0,0 +1,172 @@
+#pragma once
+
+#include "defines.h"
+#include "fftw.h"
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <boost/filesystem.hpp>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+// Holds an advisory flock(2) on the lock file that guards a wisdom file, so decon
+// jobs running concurrently on the same node read and merge the cache safely.
+class WisdomLock
+{
+public:
+    WisdomLock(const std::string &wisdom_path, bool exclusive)
+    {
+        lock_path_ = wisdom_path + ".lock";
+        fd_ = open(lock_path_.c_str(), O_RDWR | O_CREAT, 0666);
+        if (fd_ >= 0 && flock(fd_, exclusive ? LOCK_EX : LOCK_SH) != 0)
+        {
+            close(fd_);
+            fd_ = -1;
+        }
+    }
+
+    ~WisdomLock()
+    {
+        if (fd_ >= 0)
+        {
+            flock(fd_, LOCK_UN);
+            close(fd_);
+        }
+    }
+
+    WisdomLock(const WisdomLock &) = delete;
+    WisdomLock &operator=(const WisdomLock &) = delete;
+
+    bool IsLocked() const { return fd_ >= 0; }
+
+private:
+    std::string lock_path_;
+    int fd_ = -1;
+};
+
+// Returns the CPU model name as a file-name-safe string
+std::string CPUIdentifier()
+{
+    std::string model = "unknown-cpu";
+
+    std::ifstream cpuinfo("/proc/cpuinfo");
+    std::string line;
+    while (std::getline(cpuinfo, line))
+    {
+        if (line.compare(0, 10, "model name") == 0)
+        {
+            size_t colon = line.find(':');
+            if (colon != std::string::npos)
+                model = line.substr(colon + 1);
+            break;
+        }
+    }
+
+    std::string id;
+    for (char c : model)
+    {
+        if (std::isalnum(static_cast<unsigned char>(c)))
+            id += c;
+        else if (!id.empty() && id.back() != '-')
+            id += '-';
+    }
+    while (!id.empty() && id.back() == '-')
+        id.pop_back();
+
+    return id.empty() ? "unknown-cpu" : id;
+}
+
+// Builds the wisdom cache file path for a problem. Plans depend on the transform size,
+// the precision, the number of FFTW threads and the CPU, so all of them are part of the key.
+std::string WisdomFilePath(const std::string &wisdom_dir, const std::string &size_key, unsigned int threads)
+{
+    std::ostringstream name;
+    name << "fftw-wisdom_" << CPUIdentifier()
+         << "_f" << (sizeof(kPixelType) * 8)
+         << "_t" << threads
+         << "_" << size_key << ".wis";
+
+    boost::filesystem::path p(wisdom_dir);
+    p /= name.str();
+
+    return p.string();
+}
+
+// Maps a --plan-rigor value (estimate, measure, patient, exhaustive) to the FFTW flag name
+// understood by itk::FFTWGlobalConfiguration. Returns an empty string on an unknown value.
+std::string PlanRigorName(std::string rigor)
+{
+    std::transform(rigor.begin(), rigor.end(), rigor.begin(), [](unsigned char c) { return std::tolower(c); });
+
+    if (rigor == "estimate" || rigor == "measure" || rigor == "patient" || rigor == "exhaustive")
+    {
+        std::transform(rigor.begin(), rigor.end(), rigor.begin(), [](unsigned char c) { return std::toupper(c); });
+        return "FFTW_" + rigor;
+    }
+
+    return "";
+}
+
+// Loads previously saved wisdom so FFTW can skip measuring plans it has already seen
+bool ImportFFTWWisdom(const std::string &wisdom_path, bool verbose=false)
+{
+#ifdef LLSM_HAVE_FFTW
+    if (!boost::filesystem::exists(wisdom_path))
+    {
+        if (verbose)
+            std::cout << "No FFTW wisdom cached at " << wisdom_path << std::endl;
+        return false;
+    }
+
+    WisdomLock lock(wisdom_path, false);
+    bool imported = LLSM_FFTW(import_wisdom_from_filename)(wisdom_path.c_str()) != 0;
+
+    if (verbose)
+        std::cout << (imported ? "Imported FFTW wisdom from " : "Failed to import FFTW wisdom from ") << wisdom_path << std::endl;
+
+    return imported;
+#else
+    if (verbose)
+        std::cout << "Warning: FFTW wisdom is not available for the working precision" << std::endl;
+    return false;
+#endif
+}
+
+// Saves the accumulated wisdom, merging with anything written by concurrent jobs
+// since it was imported. The file is replaced atomically under an exclusive lock.
+bool ExportFFTWWisdom(const std::string &wisdom_path, bool verbose=false)
+{
+#ifdef LLSM_HAVE_FFTW
+    boost::system::error_code ec;
+    boost::filesystem::create_directories(boost::filesystem::path(wisdom_path).parent_path(), ec);
+
+    WisdomLock lock(wisdom_path, true);
+    if (!lock.IsLocked())
+    {
+        std::cerr << "Warning: unable to lock FFTW wisdom file " << wisdom_path << std::endl;
+        return false;
+    }
+
+    if (boost::filesystem::exists(wisdom_path))
+        LLSM_FFTW(import_wisdom_from_filename)(wisdom_path.c_str());
+
+    std::string tmp_path = wisdom_path + ".tmp." + std::to_string(getpid());
+    bool exported = LLSM_FFTW(export_wisdom_to_filename)(tmp_path.c_str()) != 0;
+    if (exported)
+        exported = std::rename(tmp_path.c_str(), wisdom_path.c_str()) == 0;
+    if (!exported)
+        std::remove(tmp_path.c_str());
+
+    if (verbose)
+        std::cout << (exported ? "Saved FFTW wisdom to " : "Failed to save FFTW wisdom to ") << wisdom_path << std::endl;
+
+    return exported;
+#else
+    return false;
+#endif
+}
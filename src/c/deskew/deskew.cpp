@@ -3,6 +3,7 @@
 #include "utils.h"
 #include "reader.h"
 #include "writer.h"
+#include "resampler.h"
 #include <algorithm>
 #include <boost/program_options.hpp>
 
@@ -15,7 +16,13 @@ int main(int argc, char** argv) {
   float angle = UNSET_FLOAT;
   float fill_value = UNSET_FLOAT;
   unsigned int bit_depth = UNSET_UNSIGNED_INT;
+  std::string compression = "";
   unsigned int threadnum = UNSET_UNSIGNED_INT;
+  unsigned int slab_planes = UNSET_UNSIGNED_INT;
+  bool stream = UNSET_BOOL;
+  bool rotate = UNSET_BOOL;
+  bool mip = UNSET_BOOL;
+  unsigned int blocks = UNSET_UNSIGNED_INT;
   bool overwrite = UNSET_BOOL;
   bool verbose = UNSET_BOOL;
 
@@ -29,7 +36,13 @@ int main(int argc, char** argv) {
       ("fill,f", po::value<float>(&fill_value)->default_value(0.0f), "value used to fill empty deskew regions")
       ("output,o", po::value<std::string>()->required(),"output file path")
       ("bit-depth,b", po::value<unsigned int>(&bit_depth)->default_value(16),"bit depth (8, 16, or 32) of output image")
+      ("compression", po::value<std::string>(&compression)->default_value("none"),"lossless compression of output TIFFs (none, lzw, deflate, or zstd)")
       ("thread,t", po::value<unsigned int>(&threadnum)->default_value(1),"number of threads")
+      ("rotate", po::value<bool>(&rotate)->default_value(false)->implicit_value(true)->zero_tokens(), "also rotate into coverslip coordinates with isotropic voxels")
+      ("mip", po::value<bool>(&mip)->default_value(false)->implicit_value(true)->zero_tokens(), "write x, y and z maximum projections of the deskewed stack instead of the stack")
+      ("blocks", po::value<unsigned int>(&blocks)->default_value(0), "split the output into this many z blocks, each cropped to its data (0 keeps the full output)")
+      ("stream", po::value<bool>(&stream)->default_value(false)->implicit_value(true)->zero_tokens(), "deskew a TIFF stack slab by slab with bounded memory")
+      ("slab", po::value<unsigned int>(&slab_planes)->default_value(16), "planes per slab when streaming or projecting")
       ("overwrite,w", po::value<bool>(&overwrite)->default_value(false)->implicit_value(true)->zero_tokens(), "overwrite output if it exists")
       ("verbose,v", po::value<bool>(&verbose)->default_value(false)->implicit_value(true)->zero_tokens(), "display progress and debug information")
       ("version", "display the version number")
@@ -104,6 +117,13 @@ int main(int argc, char** argv) {
     return EXIT_FAILURE;
   }
 
+  // check compression
+  uint16_t compression_scheme = COMPRESSION_NONE;
+  if (!ParseTiffCompression(compression, compression_scheme)) {
+    std::cerr << "deskew: compression must be none, lzw, deflate, or zstd, and supported by the TIFF library" << std::endl;
+    return EXIT_FAILURE;
+  }
+
   // check angle
   if (fabs(angle) > 360.0) {
     std::cerr << "deskew: angle must be within [-360,360]" << std::endl;
@@ -120,7 +140,125 @@ int main(int argc, char** argv) {
     std::cout << "Input Path = " << in_path << "\n";
     std::cout << "Output Path = " << out_path << "\n";
     std::cout << "Overwrite = " << overwrite << "\n";
-    std::cout << "Bit Depth = " << bit_depth << std::endl;
+    std::cout << "Compression = " << compression << "\n";
+    std::cout << "Bit Depth = " << bit_depth << "\n";
+    std::cout << "Rotate = " << rotate << "\n";
+    std::cout << "Stream = " << stream << "\n";
+    std::cout << "MIP = " << mip << "\n";
+    std::cout << "Blocks = " << blocks << std::endl;
+  }
+
+  // check rotation
+  if (rotate && stream) {
+    std::cerr << "deskew: rotate cannot be combined with stream" << std::endl;
+    return EXIT_FAILURE;
+  }
+  if (rotate && fabs(sin(angle * M_PI/180.0)) < EPSILON) {
+    std::cerr << "deskew: rotate requires an angle that is not a multiple of 180 degrees" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  if (rotate && mip) {
+    std::cerr << "deskew: rotate cannot be combined with mip" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  if (blocks > 0 && (rotate || stream || mip)) {
+    std::cerr << "deskew: blocks cannot be combined with rotate, stream, or mip" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  // check slab size
+  if ((stream || mip) && slab_planes == 0) {
+    std::cerr << "deskew: slab must be at least one plane" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  // the fill value is given in the input's pixel type and is scaled with its pixels
+  kPixelType fill;
+  if (!ReadFileValue(in_path, fill_value, fill)) {
+    std::cerr << "deskew: unable to read " << in_path << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  // streaming deskew and projections, only the image header is read up front
+  if (stream || mip) {
+    kImageType::SizeType img_size;
+    kImageType::SpacingType img_spacing;
+    if (!ReadImageGeometry<kImageType>(in_path, img_size, img_spacing)) {
+      std::cerr << "deskew: unable to read " << in_path << std::endl;
+      return EXIT_FAILURE;
+    }
+    if (xy_res > 0.0) {
+      img_spacing[0] = xy_res;
+      img_spacing[1] = xy_res;
+    }
+    if (step > 0.0)
+      img_spacing[2] = step;
+
+    if (mip) {
+      DeskewProjections projections;
+      if (!DeskewProjectStream(in_path, angle, img_spacing[2], img_spacing[0], fill, slab_planes, projections, verbose)) {
+        std::cerr << "deskew: deskewed projection failed" << std::endl;
+        return EXIT_FAILURE;
+      }
+
+      // x and y projections span z, which is resampled to the x/y resolution like mip does
+      const double xy_spacing = img_spacing[0];
+      const double z_spacing = fabs(img_spacing[2] * sin(angle * M_PI/180.0));
+      kSliceType::SpacingType out_spacing;
+      out_spacing[0] = xy_spacing;
+      out_spacing[1] = xy_spacing;
+
+      kSliceType::Pointer mip_imgs[] = {
+        ProjectionToImage(projections.x, projections.height, projections.depth, xy_spacing, z_spacing),
+        ProjectionToImage(projections.y, projections.width, projections.depth, xy_spacing, z_spacing),
+        ProjectionToImage(projections.z, projections.width, projections.height, xy_spacing, xy_spacing)
+      };
+      std::string labels[] = {"_x", "_y", "_z"};
+
+      for (unsigned int i = 0; i < 3; ++i) {
+        kSliceType::Pointer mip_img = mip_imgs[i];
+        if (i < 2 && z_spacing != xy_spacing && z_spacing > 0.0)
+          mip_img = Resampler(mip_img, out_spacing, verbose);
+
+        kSliceType::SpacingType mip_spacing;
+        mip_spacing[0] = 1.0;
+        mip_spacing[1] = 1.0;
+        mip_img->SetSpacing(mip_spacing);
+
+        std::string axis_out_path = AppendPath(out_path, labels[i]);
+        if (bit_depth == 8) {
+          using ImageTypeOut = itk::Image<unsigned char, 2>;
+          WriteImageFile<kSliceType,ImageTypeOut>(mip_img, axis_out_path, verbose, false, true, "", compression_scheme);
+        } else if (bit_depth == 16) {
+          using ImageTypeOut = itk::Image<unsigned short, 2>;
+          WriteImageFile<kSliceType,ImageTypeOut>(mip_img, axis_out_path, verbose, false, true, "", compression_scheme);
+        } else {
+          using ImageTypeOut = itk::Image<float, 2>;
+          WriteImageFile<kSliceType,ImageTypeOut>(mip_img, axis_out_path, verbose, false, true, "", compression_scheme);
+        }
+      }
+
+      return EXIT_SUCCESS;
+    }
+
+    bool streamed = false;
+    if (bit_depth == 8)
+      streamed = DeskewStream<unsigned char>(in_path, out_path, angle, img_spacing[2], img_spacing[0], fill, slab_planes, verbose, compression_scheme);
+    else if (bit_depth == 16)
+      streamed = DeskewStream<unsigned short>(in_path, out_path, angle, img_spacing[2], img_spacing[0], fill, slab_planes, verbose, compression_scheme);
+    else
+      streamed = DeskewStream<float>(in_path, out_path, angle, img_spacing[2], img_spacing[0], fill, slab_planes, verbose, compression_scheme);
+
+    if (!streamed) {
+      std::cerr << "deskew: streaming deskew failed" << std::endl;
+      return EXIT_FAILURE;
+    }
+    if (verbose)
+      std::cout << "Wrote " << out_path << std::endl;
+
+    return EXIT_SUCCESS;
   }
 
   // deskew
@@ -134,21 +272,61 @@ int main(int argc, char** argv) {
   if (step > 0.0)
     img_spacing[2] = step;
 
-  kImageType::Pointer deskew_img = Deskew(img, angle, img_spacing[2], img_spacing[0], (kPixelType) fill_value/std::numeric_limits<unsigned short>::max(), verbose); // TODO: scale fill_value by input type
+  // deskew into blocks cropped to the data, each written with its place in the full stack
+  if (blocks > 0) {
+    kImageType::SizeType img_size = img->GetLargestPossibleRegion().GetSize();
+    const DeskewGeometry geometry = ComputeDeskewGeometry(img_size[0], img_size[2], angle, img_spacing[2], img_spacing[0]);
+    const std::vector<DeskewBlock> deskew_blocks = ComputeDeskewBlocks(geometry, img_size[0], img_size[2], blocks);
+
+    for (size_t b = 0; b < deskew_blocks.size(); ++b) {
+      const DeskewBlock &block = deskew_blocks[b];
+      std::string block_path = (deskew_blocks.size() == 1) ? std::string(out_path) : AppendPath(out_path, "_block" + std::to_string(b));
+      std::string metadata = DeskewBlockMetadata(geometry, img_size[0], block, b, deskew_blocks.size());
+      if (verbose) {
+        std::cout << "Block " << b << " = columns " << block.x_begin << "-" << block.x_end << " of " << geometry.width
+                  << ", slices " << block.z_begin << "-" << block.z_end << std::endl;
+      }
+
+      kImageType::Pointer block_img = DeskewBlockImage(img, geometry, block, fill);
+      if (bit_depth == 8) {
+        using ImageTypeOut = itk::Image<unsigned char, kDimensions>;
+        WriteImageFile<kImageType,ImageTypeOut>(block_img, block_path, verbose, false, true, metadata, compression_scheme);
+      } else if (bit_depth == 16) {
+        using ImageTypeOut = itk::Image<unsigned short, kDimensions>;
+        WriteImageFile<kImageType,ImageTypeOut>(block_img, block_path, verbose, false, true, metadata, compression_scheme);
+      } else {
+        using ImageTypeOut = itk::Image<float, kDimensions>;
+        WriteImageFile<kImageType,ImageTypeOut>(block_img, block_path, verbose, false, true, metadata, compression_scheme);
+      }
+    }
+
+    return EXIT_SUCCESS;
+  }
+
+  kImageType::Pointer deskew_img;
+  if (rotate) {
+    if (img_spacing[2] == 0.0) {
+      std::cerr << "deskew: rotate requires a non-zero step" << std::endl;
+      return EXIT_FAILURE;
+    }
+    deskew_img = DeskewRotate(img, angle, img_spacing[2], img_spacing[0], fill, verbose);
+  } else {
+    deskew_img = Deskew(img, angle, img_spacing[2], img_spacing[0], fill, verbose);
+  }
   
   // write file
   if (bit_depth == 8) {
     using PixelTypeOut = unsigned char;
     using ImageTypeOut = itk::Image<PixelTypeOut, kDimensions>;
-    WriteImageFile<kImageType,ImageTypeOut>(deskew_img, out_path, verbose, false);
+    WriteImageFile<kImageType,ImageTypeOut>(deskew_img, out_path, verbose, false, true, "", compression_scheme);
   } else if (bit_depth == 16) {
     using PixelTypeOut = unsigned short;
     using ImageTypeOut = itk::Image<PixelTypeOut, kDimensions>;
-    WriteImageFile<kImageType,ImageTypeOut>(deskew_img, out_path, verbose, false);
+    WriteImageFile<kImageType,ImageTypeOut>(deskew_img, out_path, verbose, false, true, "", compression_scheme);
   } else if (bit_depth == 32) {
     using PixelTypeOut = float;
     using ImageTypeOut = itk::Image<PixelTypeOut, kDimensions>;
-    WriteImageFile<kImageType,ImageTypeOut>(deskew_img, out_path, verbose, false);
+    WriteImageFile<kImageType,ImageTypeOut>(deskew_img, out_path, verbose, false, true, "", compression_scheme);
   } else {
     std::cerr << "deskew: unknown bit depth" << std::endl;
     return EXIT_FAILURE;
@@ -4,82 +4,384 @@
 #define _USE_MATH_DEFINES
 
 #include "defines.h"
+#include "parallel.h"
+#include "pipeline.h"
+#include "stream.h"
+#include <algorithm>
+#include <atomic>
 #include <cmath>
+#include <limits>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
 #include <itkImage.h>
 #include <itkImageBase.h>
-#include <itkResampleImageFilter.h>
-#include "itkAffineTransform.h"
-#include "itkLinearInterpolateImageFunction.h"
 #include <itkMultiThreaderBase.h>
 
-kImageType::Pointer Deskew(kImageType::Pointer img, float angle, float step, float xy_res, kPixelType fill_value, bool verbose=false)
+// Geometry of the stage-scan shear. Output slice z is input slice z translated along x, so
+// that input x = output x + Offset(z).
+struct DeskewGeometry
 {
-  img->SetSpacing((1.0, 1.0, 1.0));
+  double shift;       // x shift between consecutive slices (px)
+  double translation; // moves the output into positive x when the shift is negative
+  size_t width;       // output x size (px)
 
-  // compute shift
-  const double shift = step * cos(angle * M_PI/180.0) / xy_res;
+  double Offset(size_t z) const { return -shift * double(z) - translation; }
+};
 
-  if (verbose)
+DeskewGeometry ComputeDeskewGeometry(size_t width, size_t depth, float angle, float step, float xy_res)
+{
+  DeskewGeometry geometry;
+  geometry.shift = step * cos(angle * M_PI/180.0) / xy_res;
+  geometry.width = ceil(width + (fabs(geometry.shift) * (depth-1)));
+  geometry.translation = (geometry.shift < 0) ? double(long(geometry.width) - long(width)) : 0.0;
+  return geometry;
+}
+
+// Shears the rows of one slice, rows of in_width pixels into rows of out_width pixels. The
+// offset is constant across the slice, so resampling is a 1D linear interpolation along
+// contiguous rows with one whole-pixel offset and one fraction.
+template <class TPixel>
+void DeskewSlice(const TPixel *in, size_t in_width, size_t rows, TPixel *out, size_t out_width, double offset, TPixel fill_value)
+{
+  const long in_nx = in_width;
+  const long nx = out_width;
+  const long whole = long(std::floor(offset));
+  const TPixel fraction = TPixel(offset - double(whole));
+
+  // output x whose input position lies inside [-0.5, in_nx - 0.5), the extent of the input
+  // pixels, and the part of those whose two neighbours are both inside the input
+  const long valid_begin = std::max(0L, long(std::ceil(-0.5 - offset)));
+  const long valid_end = std::max(valid_begin, std::min(nx, long(std::ceil(double(in_nx) - 0.5 - offset))));
+  const long inner_begin = std::min(std::max(valid_begin, -whole), valid_end);
+  const long inner_end = std::max(std::min(valid_end, in_nx - 1 - whole), inner_begin);
+
+  for (size_t y = 0; y < rows; ++y)
   {
-    std::cout << "\nDeskew Parameters\n";
-    std::cout << "Shift (px) = " << shift << "\n";
+    const TPixel *row = in + y * in_width;
+    TPixel *out_row = out + y * out_width;
+
+    // samples within half a pixel of the first or last input pixel take its value
+    std::fill(out_row, out_row + valid_begin, fill_value);
+    std::fill(out_row + valid_begin, out_row + inner_begin, row[0]);
+
+    const TPixel *left = row + whole;
+    for (long x = inner_begin; x < inner_end; ++x)
+      out_row[x] = left[x] + fraction * (left[x + 1] - left[x]);
+
+    std::fill(out_row + inner_end, out_row + valid_end, row[in_nx - 1]);
+    std::fill(out_row + valid_end, out_row + nx, fill_value);
   }
+}
+
+// Part of the deskewed stack: slices [z_begin, z_end) cropped to columns [x_begin, x_end)
+struct DeskewBlock
+{
+  size_t x_begin;
+  size_t x_end;
+  size_t z_begin;
+  size_t z_end;
+};
+
+// First and one past the last output column of slice z that hold data rather than fill
+void DeskewDataColumns(const DeskewGeometry &geometry, size_t in_width, size_t z, size_t &begin, size_t &end)
+{
+  const double offset = geometry.Offset(z);
+  begin = size_t(std::max(0.0, std::ceil(-0.5 - offset)));
+  end = size_t(std::max(0.0, std::min(double(geometry.width), std::ceil(double(in_width) - 0.5 - offset))));
+  end = std::max(begin, end);
+}
+
+// Splits the deskewed stack into blocks of consecutive slices, each cropped to the columns
+// holding data. The data of a slice moves linearly with z, so the first and last slice of a
+// block bound its columns. More blocks trim more of the fill around the parallelogram.
+std::vector<DeskewBlock> ComputeDeskewBlocks(const DeskewGeometry &geometry, size_t in_width, size_t depth, size_t blocks)
+{
+  blocks = std::max<size_t>(1, std::min(blocks, depth));
+  std::vector<DeskewBlock> result;
+  for (size_t b = 0; b < blocks; ++b)
+  {
+    DeskewBlock block;
+    block.z_begin = b * depth / blocks;
+    block.z_end = (b + 1) * depth / blocks;
+
+    size_t first_begin, first_end, last_begin, last_end;
+    DeskewDataColumns(geometry, in_width, block.z_begin, first_begin, first_end);
+    DeskewDataColumns(geometry, in_width, block.z_end - 1, last_begin, last_end);
+    block.x_begin = std::min(first_begin, last_begin);
+    block.x_end = std::max(first_end, last_end);
+    result.push_back(block);
+  }
+  return result;
+}
+
+// Records where a block sits in the deskewed stack as ImageJ description lines, so later
+// stages can skip fill. The data of slice k of the block starts near column
+// deskew_data_start + k * deskew_shift and is deskew_data_width columns wide.
+std::string DeskewBlockMetadata(const DeskewGeometry &geometry, size_t in_width, const DeskewBlock &block, size_t index, size_t count)
+{
+  size_t data_begin, data_end;
+  DeskewDataColumns(geometry, in_width, block.z_begin, data_begin, data_end);
+
+  std::ostringstream metadata;
+  metadata << "deskew_block=" << index << "\n";
+  metadata << "deskew_blocks=" << count << "\n";
+  metadata << "deskew_x_offset=" << block.x_begin << "\n";
+  metadata << "deskew_z_offset=" << block.z_begin << "\n";
+  metadata << "deskew_full_width=" << geometry.width << "\n";
+  metadata << "deskew_shift=" << geometry.shift << "\n";
+  metadata << "deskew_data_start=" << long(data_begin) - long(block.x_begin) << "\n";
+  metadata << "deskew_data_width=" << in_width;
+  return metadata.str();
+}
+
+// Deskews the slices and columns of one block of the output
+template <class TImage>
+itk::SmartPointer<TImage> DeskewBlockImage(itk::SmartPointer<TImage> img, const DeskewGeometry &geometry, const DeskewBlock &block, typename TImage::PixelType fill_value)
+{
+  const typename TImage::SizeType in_size = img->GetLargestPossibleRegion().GetSize();
+  const size_t in_width = in_size[0], ny = in_size[1];
+  const size_t width = block.x_end - block.x_begin;
+
+  typename TImage::SizeType size;
+  size[0] = width;
+  size[1] = ny;
+  size[2] = block.z_end - block.z_begin;
+
+  itk::SmartPointer<TImage> outimg = TImage::New();
+  typename TImage::RegionType region;
+  region.SetSize(size);
+  outimg->SetRegions(region);
+  outimg->Allocate();
+
+  const typename TImage::PixelType *in = img->GetBufferPointer();
+  typename TImage::PixelType *out = outimg->GetBufferPointer();
+
+  ParallelFor(size[2], itk::MultiThreaderBase::GetGlobalDefaultNumberOfThreads(), [&](size_t begin, size_t end) {
+    for (size_t k = begin; k < end; ++k)
+    {
+      const size_t z = block.z_begin + k;
+      DeskewSlice(in + z * ny * in_width, in_width, ny, out + k * ny * width, width, geometry.Offset(z) + double(block.x_begin), fill_value);
+    }
+  }, 1);
+
+  return outimg;
+}
+
+template <class TImage>
+itk::SmartPointer<TImage> Deskew(itk::SmartPointer<TImage> img, float angle, float step, float xy_res, typename TImage::PixelType fill_value, bool verbose=false)
+{
+  img->SetSpacing((1.0, 1.0, 1.0));
 
   // calculate and set output size
-  kImageType::SizeType size = img->GetLargestPossibleRegion().GetSize();
+  typename TImage::SizeType size = img->GetLargestPossibleRegion().GetSize();
+  const DeskewGeometry geometry = ComputeDeskewGeometry(size[0], size[2], angle, step, xy_res);
 
   if (verbose)
   {
+    std::cout << "\nDeskew Parameters\n";
+    std::cout << "Shift (px) = " << geometry.shift << "\n";
     std::cout << "Input Dimensions (px) = " << size[0] << " x " << size[1] << " x " << size[2] << "\n";
+    std::cout << "Output Dimensions (px) = " << geometry.width << " x " << size[1] << " x " << size[2] << "\n";
   }
 
-  int orgx = size[0];
-  size[0] = ceil(size[0] + (fabs(shift) * (size[2]-1)));
+  const DeskewBlock block = {0, geometry.width, 0, size[2]};
+  itk::SmartPointer<TImage> outimg = DeskewBlockImage(img, geometry, block, fill_value);
+
+  // set spacing
+  typename TImage::SpacingType spacing;
+  spacing[0] = xy_res;
+  spacing[1] = xy_res;
+  spacing[2] = fabs(step * sin(angle * M_PI/180.0));
+
+  img->SetSpacing(spacing);
 
   if (verbose)
   {
-    std::cout << "Output Dimensions (px) = " << size[0] << " x " << size[1] << " x " << size[2] << "\n";
+    std::cout << "Output Resolution (um/px) = " << spacing[0] << " x " << spacing[1] << " x " << spacing[2] << std::endl;
   }
 
-  // set up resample filter
-  using FilterType = itk::ResampleImageFilter<kImageType, kImageType>;
-  FilterType::Pointer filter = FilterType::New();
+  return outimg;
+}
+
+// Coverslip frame of a stage scan, in units of xy_res. Raw pixel (x, z) lies at
+// X = x cos(angle) + z step/xy_res and Z = -x sin(angle), which is the deskew shear followed
+// by a rotation about y by the objective angle and a rescaling of z to isotropic voxels.
+struct RotateGeometry
+{
+  double cos_angle;
+  double sin_angle;
+  double stage_step; // stage step between slices (px)
+  double x_min;      // coverslip X of the first output column
+  double z_min;      // coverslip Z of the first output slice
+  size_t width;      // output x size (px)
+  size_t depth;      // output z size (px)
+
+  // raw x of output slice k, the same for every pixel of the slice
+  double RawX(size_t k) const { return -(z_min + double(k)) / sin_angle; }
+
+  // raw z of output column i in output slice k
+  double RawZ(size_t k, size_t i) const { return (x_min + double(i) - RawX(k) * cos_angle) / stage_step; }
+};
+
+// Fits the output box tightly around the raw stack, whose corners span the extent in X and Z
+RotateGeometry ComputeRotateGeometry(size_t width, size_t depth, float angle, float step, float xy_res)
+{
+  RotateGeometry geometry;
+  geometry.cos_angle = cos(angle * M_PI/180.0);
+  geometry.sin_angle = sin(angle * M_PI/180.0);
+  geometry.stage_step = step / xy_res;
 
-  using TransformType = itk::AffineTransform<double, kDimensions>;
-  TransformType::Pointer transform = TransformType::New();
-  transform->Shear(0, 2, -shift);
-  if (shift < 0)
+  double x_max = -std::numeric_limits<double>::infinity(), z_max = x_max;
+  geometry.x_min = geometry.z_min = std::numeric_limits<double>::infinity();
+  for (double x : {0.0, double(width - 1)})
   {
-    int transx = size[0] - orgx;
-    TransformType::OutputVectorType translation;
-    translation[0] = -transx; // X translation
-    translation[1] = 0; // Y translation
-    translation[2] = 0; // Z translation
-    transform->Translate(translation);
+    for (double z : {0.0, double(depth - 1)})
+    {
+      const double cx = x * geometry.cos_angle + z * geometry.stage_step;
+      const double cz = -x * geometry.sin_angle;
+      geometry.x_min = std::min(geometry.x_min, cx);
+      geometry.z_min = std::min(geometry.z_min, cz);
+      x_max = std::max(x_max, cx);
+      z_max = std::max(z_max, cz);
+    }
   }
-  filter->SetTransform(transform);
 
-  using InterpolatorType = itk::LinearInterpolateImageFunction<kImageType, double>;
-  InterpolatorType::Pointer interpolator = InterpolatorType::New();
-  filter->SetInterpolator(interpolator);
+  // tolerate rounding so the last sample on the data boundary is kept
+  geometry.width = size_t(std::floor(x_max - geometry.x_min + 1e-6)) + 1;
+  geometry.depth = size_t(std::floor(z_max - geometry.z_min + 1e-6)) + 1;
+  return geometry;
+}
 
-  filter->SetDefaultPixelValue(fill_value);
+// output slices gathered together from each raw row by DeskewRotate, and the bytes of
+// gathered columns each thread keeps, which sets how many rows are gathered at a time
+constexpr size_t kRotateSliceBlock = 32;
+constexpr size_t kRotateGatherBytes = 4 * 1024 * 1024;
 
-  filter->SetSize(size);
+// Deskews and rotates a stage scan into coverslip coordinates with isotropic xy_res voxels
+// in a single interpolation pass. Every output slice samples the raw stack at one raw x, so
+// each slice is a linear interpolation along x into a y by z plane followed by a linear
+// interpolation along z for every output row, which together are the trilinear sample.
+template <class TImage>
+itk::SmartPointer<TImage> DeskewRotate(itk::SmartPointer<TImage> img, float angle, float step, float xy_res, typename TImage::PixelType fill_value, bool verbose=false)
+{
+  using PixelType = typename TImage::PixelType;
 
-  // perform deskew
-  filter->SetInput(img);
-  filter->Update();
+  typename TImage::SizeType size = img->GetLargestPossibleRegion().GetSize();
+  const RotateGeometry geometry = ComputeRotateGeometry(size[0], size[2], angle, step, xy_res);
+  const size_t nx = size[0], ny = size[1], nz = size[2];
 
-  kImageType::Pointer outimg = filter->GetOutput();
+  typename TImage::SizeType out_size;
+  out_size[0] = geometry.width;
+  out_size[1] = ny;
+  out_size[2] = geometry.depth;
 
-  // set spacing
-  kImageType::SpacingType spacing;
+  if (verbose)
+  {
+    std::cout << "\nDeskew and Rotate Parameters\n";
+    std::cout << "Stage Step (px) = " << geometry.stage_step << "\n";
+    std::cout << "Input Dimensions (px) = " << nx << " x " << ny << " x " << nz << "\n";
+    std::cout << "Output Dimensions (px) = " << out_size[0] << " x " << out_size[1] << " x " << out_size[2] << "\n";
+  }
+
+  itk::SmartPointer<TImage> outimg = TImage::New();
+  typename TImage::RegionType region;
+  region.SetSize(out_size);
+  outimg->SetRegions(region);
+  outimg->Allocate();
+
+  typename TImage::SpacingType spacing;
   spacing[0] = xy_res;
   spacing[1] = xy_res;
-  spacing[2] = fabs(step * sin(angle * M_PI/180.0));
+  spacing[2] = xy_res;
+  outimg->SetSpacing(spacing);
 
-  img->SetSpacing(spacing);
+  const PixelType *in = img->GetBufferPointer();
+  PixelType *out = outimg->GetBufferPointer();
+  const size_t out_nx = geometry.width;
+
+  // Consecutive output slices sample adjacent raw x, so every thread takes a contiguous run
+  // of slices and gathers a block of them from each raw row in one visit, which reads each
+  // cache line of the stack once per block rather than once per slice. The gathered columns
+  // are kept for a block of rows at a time, z fastest, to bound the buffer.
+  const size_t slice_block = kRotateSliceBlock;
+  const size_t row_block = std::max<size_t>(1, std::min(ny, kRotateGatherBytes / (slice_block * nz * sizeof(PixelType))));
+
+  ParallelFor(geometry.depth, itk::MultiThreaderBase::GetGlobalDefaultNumberOfThreads(), [&](size_t begin, size_t end) {
+    std::vector<PixelType> columns(slice_block * row_block * nz);
+    std::vector<size_t> slices, x0s, x1s;
+    std::vector<PixelType> fxs;
+
+    for (size_t k_first = begin; k_first < end; k_first += slice_block)
+    {
+      // slices that sample the raw stack, the others are all fill
+      slices.clear();
+      x0s.clear();
+      x1s.clear();
+      fxs.clear();
+      for (size_t k = k_first; k < std::min(end, k_first + slice_block); ++k)
+      {
+        const double x = geometry.RawX(k);
+        if (!(x >= -0.5 && x < double(nx) - 0.5))
+        {
+          PixelType *out_slice = out + k * ny * out_nx;
+          std::fill(out_slice, out_slice + ny * out_nx, fill_value);
+          continue;
+        }
+
+        // samples within half a pixel of the first or last raw pixel take its value
+        const size_t x0 = size_t(std::max(0.0, std::floor(x)));
+        slices.push_back(k);
+        x0s.push_back(x0);
+        x1s.push_back(std::min(x0 + 1, nx - 1));
+        fxs.push_back(PixelType(std::max(0.0, x - double(x0))));
+      }
+      const size_t count = slices.size();
+
+      for (size_t y_first = 0; y_first < ny; y_first += row_block)
+      {
+        const size_t rows = std::min(row_block, ny - y_first);
+
+        // interpolation along x of every slice of the block from each raw row
+        for (size_t z = 0; z < nz; ++z)
+        {
+          for (size_t r = 0; r < rows; ++r)
+          {
+            const PixelType *row = in + (z * ny + y_first + r) * nx;
+            for (size_t b = 0; b < count; ++b)
+              columns[(b * row_block + r) * nz + z] = row[x0s[b]] + fxs[b] * (row[x1s[b]] - row[x0s[b]]);
+          }
+        }
+
+        // interpolation along z for every output row
+        const double z_step = 1.0 / geometry.stage_step;
+        for (size_t b = 0; b < count; ++b)
+        {
+          const size_t k = slices[b];
+          const double z_first = geometry.RawZ(k, 0);
+          for (size_t r = 0; r < rows; ++r)
+          {
+            const PixelType *column = columns.data() + (b * row_block + r) * nz;
+            PixelType *out_row = out + (k * ny + y_first + r) * out_nx;
+            for (size_t i = 0; i < out_nx; ++i)
+            {
+              const double z = z_first + double(i) * z_step;
+              if (!(z >= -0.5 && z < double(nz) - 0.5))
+              {
+                out_row[i] = fill_value;
+                continue;
+              }
+              const size_t z0 = size_t(std::max(0.0, std::floor(z)));
+              const size_t z1 = std::min(z0 + 1, nz - 1);
+              const PixelType fz = PixelType(std::max(0.0, z - double(z0)));
+              out_row[i] = column[z0] + fz * (column[z1] - column[z0]);
+            }
+          }
+        }
+      }
+    }
+  }, 1);
 
   if (verbose)
   {
@@ -87,4 +389,226 @@ kImageType::Pointer Deskew(kImageType::Pointer img, float angle, float step, flo
   }
 
   return outimg;
-}
\ No newline at end of file
+}
+
+// Deskews a TIFF stack slab by slab, so peak memory depends on the slab size rather than on
+// the number of slices. Reading, shearing and writing run as concurrent pipeline stages
+// connected by bounded queues. The output is converted to TPixelOut and written like the
+// in-memory path, which deskews into an image of unit spacing.
+template <class TPixelOut>
+bool DeskewStream(const std::string &in_path, const std::string &out_path, float angle, float step, float xy_res, kPixelType fill_value, size_t slab_planes, bool verbose=false, uint16_t compression=COMPRESSION_NONE)
+{
+  TiffPageReader reader;
+  if (!reader.Open(in_path))
+  {
+    std::cerr << "Unable to open " << in_path << " for streaming, only single channel, stripped TIFF stacks can be streamed" << std::endl;
+    return false;
+  }
+
+  const size_t in_width = reader.Width(), ny = reader.Height(), nz = reader.Pages();
+  const DeskewGeometry geometry = ComputeDeskewGeometry(in_width, nz, angle, step, xy_res);
+  slab_planes = std::max<size_t>(1, slab_planes);
+
+  if (verbose)
+  {
+    std::cout << "\nDeskew Parameters\n";
+    std::cout << "Shift (px) = " << geometry.shift << "\n";
+    std::cout << "Input Dimensions (px) = " << in_width << " x " << ny << " x " << nz << "\n";
+    std::cout << "Output Dimensions (px) = " << geometry.width << " x " << ny << " x " << nz << "\n";
+    std::cout << "Slab Size (planes) = " << slab_planes << std::endl;
+  }
+
+  TiffPageWriter<TPixelOut> writer;
+  if (!writer.Open(out_path, geometry.width, ny, nz, {1.0, 1.0, 1.0}, false, "", compression))
+  {
+    std::cerr << "Unable to open " << out_path << " for writing" << std::endl;
+    return false;
+  }
+
+  struct Slab
+  {
+    size_t first;
+    size_t planes;
+    std::vector<kPixelType> data;
+  };
+
+  // two slabs queued between each pair of stages keeps every stage busy
+  BoundedQueue<Slab> read_queue(2);
+  BoundedQueue<Slab> write_queue(2);
+  std::atomic<bool> failed(false);
+
+  std::thread read_stage([&]() {
+    for (size_t first = 0; first < nz && !failed; first += slab_planes)
+    {
+      Slab slab;
+      slab.first = first;
+      slab.planes = std::min(slab_planes, nz - first);
+      slab.data.resize(slab.planes * ny * in_width);
+      for (size_t p = 0; p < slab.planes && !failed; ++p)
+      {
+        if (!reader.ReadPage(first + p, slab.data.data() + p * ny * in_width))
+        {
+          std::cerr << "Unable to read page " << first + p << " of " << in_path << std::endl;
+          failed = true;
+        }
+      }
+      if (failed || !read_queue.Push(std::move(slab)))
+        break;
+    }
+    read_queue.Close();
+  });
+
+  std::thread write_stage([&]() {
+    Slab slab;
+    while (write_queue.Pop(slab))
+    {
+      for (size_t p = 0; p < slab.planes; ++p)
+      {
+        if (!writer.WritePage(slab.data.data() + p * ny * geometry.width))
+        {
+          std::cerr << "Unable to write page " << slab.first + p << " of " << out_path << std::endl;
+          failed = true;
+          write_queue.Close();
+          read_queue.Close();
+          return;
+        }
+      }
+      if (verbose)
+        std::cout << "Deskewed planes " << slab.first + 1 << "-" << slab.first + slab.planes << "/" << nz << std::endl;
+    }
+  });
+
+  // the shear runs on the calling thread, in parallel over the planes of each slab
+  const unsigned int threads = itk::MultiThreaderBase::GetGlobalDefaultNumberOfThreads();
+  Slab in;
+  while (read_queue.Pop(in))
+  {
+    Slab out;
+    out.first = in.first;
+    out.planes = in.planes;
+    out.data.resize(out.planes * ny * geometry.width);
+
+    ParallelFor(in.planes, threads, [&](size_t begin, size_t end) {
+      for (size_t p = begin; p < end; ++p)
+        DeskewSlice(in.data.data() + p * ny * in_width, in_width, ny, out.data.data() + p * ny * geometry.width, geometry.width, geometry.Offset(in.first + p), fill_value);
+    }, 1);
+
+    if (!write_queue.Push(std::move(out)))
+      break;
+  }
+  write_queue.Close();
+
+  read_stage.join();
+  write_stage.join();
+
+  if (!writer.Close()) {
+    std::cerr << "Unable to finish writing " << out_path << std::endl;
+    return false;
+  }
+  return !failed;
+}
+
+// Maximum projections of a deskewed stack, laid out like the output of
+// MaximumProjectionImageFilter: x is y by z, y is x by z and z is x by y
+struct DeskewProjections
+{
+  size_t width;  // deskewed x size (px)
+  size_t height; // y size (px)
+  size_t depth;  // z size (px)
+  std::vector<kPixelType> x;
+  std::vector<kPixelType> y;
+  std::vector<kPixelType> z;
+};
+
+// Projects the deskewed geometry of a TIFF stack along x, y and z without deskewing the
+// stack into memory. Pages are read a slab at a time and every sheared row is reduced into
+// the three projections as soon as it is computed, so only one deskewed plane per thread is
+// ever held. Fill regions take part in the projections as they would in a deskewed stack.
+bool DeskewProjectStream(const std::string &in_path, float angle, float step, float xy_res, kPixelType fill_value, size_t slab_planes, DeskewProjections &projections, bool verbose=false)
+{
+  TiffPageReader reader;
+  if (!reader.Open(in_path))
+  {
+    std::cerr << "Unable to open " << in_path << " for streaming, only single channel, stripped TIFF stacks can be streamed" << std::endl;
+    return false;
+  }
+
+  const size_t in_width = reader.Width(), ny = reader.Height(), nz = reader.Pages();
+  const DeskewGeometry geometry = ComputeDeskewGeometry(in_width, nz, angle, step, xy_res);
+  const size_t nx = geometry.width;
+  slab_planes = std::max<size_t>(1, slab_planes);
+
+  if (verbose)
+  {
+    std::cout << "\nDeskew Projection Parameters\n";
+    std::cout << "Shift (px) = " << geometry.shift << "\n";
+    std::cout << "Input Dimensions (px) = " << in_width << " x " << ny << " x " << nz << "\n";
+    std::cout << "Deskewed Dimensions (px) = " << nx << " x " << ny << " x " << nz << std::endl;
+  }
+
+  const kPixelType lowest = std::numeric_limits<kPixelType>::lowest();
+  projections.width = nx;
+  projections.height = ny;
+  projections.depth = nz;
+  projections.x.assign(ny * nz, lowest);
+  projections.y.assign(nx * nz, lowest);
+  projections.z.assign(nx * ny, lowest);
+
+  // the z projection accumulates over planes, so every thread keeps its own and they are
+  // combined at the end; x and y projections get one row per plane and need no merging
+  const unsigned int threads = itk::MultiThreaderBase::GetGlobalDefaultNumberOfThreads();
+  const unsigned int ranges = ParallelRangeCount(slab_planes, threads, 1);
+  std::vector<std::vector<kPixelType>> partial_z(ranges, std::vector<kPixelType>(nx * ny, lowest));
+  std::vector<std::vector<kPixelType>> planes(ranges, std::vector<kPixelType>(nx * ny));
+
+  std::vector<kPixelType> slab(slab_planes * ny * in_width);
+  for (size_t first = 0; first < nz; first += slab_planes)
+  {
+    const size_t count = std::min(slab_planes, nz - first);
+    for (size_t p = 0; p < count; ++p)
+    {
+      if (!reader.ReadPage(first + p, slab.data() + p * ny * in_width))
+      {
+        std::cerr << "Unable to read page " << first + p << " of " << in_path << std::endl;
+        return false;
+      }
+    }
+
+    const size_t step_planes = (count + ranges - 1) / ranges;
+    ParallelFor(ranges, ranges, [&](size_t begin, size_t end) {
+      for (size_t r = begin; r < end; ++r)
+      {
+        kPixelType *plane = planes[r].data();
+        kPixelType *z_max = partial_z[r].data();
+        for (size_t p = r * step_planes; p < std::min(count, (r + 1) * step_planes); ++p)
+        {
+          const size_t z = first + p;
+          DeskewSlice(slab.data() + p * ny * in_width, in_width, ny, plane, nx, geometry.Offset(z), fill_value);
+
+          kPixelType *y_max = projections.y.data() + z * nx;
+          for (size_t y = 0; y < ny; ++y)
+          {
+            const kPixelType *row = plane + y * nx;
+            kPixelType *z_row = z_max + y * nx;
+            kPixelType x_max = lowest;
+            for (size_t x = 0; x < nx; ++x)
+            {
+              x_max = std::max(x_max, row[x]);
+              y_max[x] = std::max(y_max[x], row[x]);
+              z_row[x] = std::max(z_row[x], row[x]);
+            }
+            projections.x[z * ny + y] = x_max;
+          }
+        }
+      }
+    }, 1);
+  }
+
+  for (const std::vector<kPixelType> &z_max : partial_z)
+  {
+    for (size_t i = 0; i < nx * ny; ++i)
+      projections.z[i] = std::max(projections.z[i], z_max[i]);
+  }
+
+  return true;
+}
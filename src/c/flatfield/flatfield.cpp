@@ -15,7 +15,10 @@ int main(int argc, char** argv) {
   float xy_res = UNSET_FLOAT;
   float img_zstep = UNSET_FLOAT;
   unsigned int bit_depth = UNSET_UNSIGNED_INT;
+  std::string compression = "";
   unsigned int threadnum = UNSET_UNSIGNED_INT;
+  unsigned int slab_planes = UNSET_UNSIGNED_INT;
+  bool stream = UNSET_BOOL;
   bool overwrite = UNSET_BOOL;
   bool verbose = UNSET_BOOL;
 
@@ -29,7 +32,10 @@ int main(int argc, char** argv) {
       ("image-spacing,q", po::value<float>(&img_zstep)->default_value(-1.0f),"z-step size of input image")
       ("output,o", po::value<std::string>()->required(),"output file path")
       ("bit-depth,b", po::value<unsigned int>(&bit_depth)->default_value(16),"bit depth (8, 16, or 32) of output image")
+      ("compression", po::value<std::string>(&compression)->default_value("none"),"lossless compression of output TIFFs (none, lzw, deflate, or zstd)")
       ("thread,t", po::value<unsigned int>(&threadnum)->default_value(1),"number of threads")
+      ("stream", po::value<bool>(&stream)->default_value(false)->implicit_value(true)->zero_tokens(), "correct a TIFF stack slab by slab with bounded memory")
+      ("slab", po::value<unsigned int>(&slab_planes)->default_value(16), "planes per slab when streaming")
       ("overwrite,w", po::value<bool>(&overwrite)->default_value(false)->implicit_value(true)->zero_tokens(), "overwrite output if it exists")
       ("verbose,v", po::value<bool>(&verbose)->default_value(false)->implicit_value(true)->zero_tokens(), "display progress and debug information")
       ("version", "display the version number")
@@ -114,6 +120,19 @@ int main(int argc, char** argv) {
     return EXIT_FAILURE;
   }
 
+  // check compression
+  uint16_t compression_scheme = COMPRESSION_NONE;
+  if (!ParseTiffCompression(compression, compression_scheme)) {
+    std::cerr << "flatfield: compression must be none, lzw, deflate, or zstd, and supported by the TIFF library" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  // check streaming options
+  if (stream && slab_planes == 0) {
+    std::cerr << "flatfield: slab must be at least 1 plane" << std::endl;
+    return EXIT_FAILURE;
+  }
+
   // print parameters
   if (verbose) {
     std::cout << "\nInput Parameters\n";
@@ -122,12 +141,12 @@ int main(int argc, char** argv) {
     std::cout << "N Image Path = " << n_path << "\n";
     std::cout << "Output Path = " << out_path << "\n";
     std::cout << "Overwrite = " << overwrite << "\n";
-    std::cout << "Bit Depth = " << bit_depth << std::endl;
+    std::cout << "Compression = " << compression << "\n";
+    std::cout << "Bit Depth = " << bit_depth << "\n";
+    std::cout << "Stream = " << stream << std::endl;
   }
 
-  // read data
-  kImageType::Pointer img = ReadImageFile<kImageType>(in_path, false, false);
-
+  // read calibration images
   //itk::Image<kPixelType, 2>::Pointer dark_tmp = ReadImageFile<itk::Image<kPixelType, 2>>(dark_path);
 
   itk::ImageIOBase::Pointer image_io = itk::ImageIOFactory::CreateImageIO(dark_path, itk::CommonEnums::IOFileMode::ReadMode);
@@ -150,6 +169,36 @@ int main(int argc, char** argv) {
   kSliceType::Pointer n_img = ReadImage<2, itk::Image<kPixelType, 2>>(n_path, component_type2, false);
   //kImageType::Pointer n_img = Convert2DImageTo3D<kPixelType>(n_img_tmp);
 
+  // streaming flatfield, only one slab of the stack is in memory at a time and the output
+  // has unit spacing like the in-memory path
+  if (stream) {
+    kSliceType::SizeType dark_size = dark->GetLargestPossibleRegion().GetSize();
+    kSliceType::SizeType n_size = n_img->GetLargestPossibleRegion().GetSize();
+    if (dark_size != n_size) {
+      std::cerr << "flatfield: dark and N images must have the same size" << std::endl;
+      return EXIT_FAILURE;
+    }
+
+    GainMap gain;
+    gain.Compute(n_img->GetBufferPointer(), n_size[0], n_size[1]);
+
+    bool streamed = false;
+    if (bit_depth == 8)
+      streamed = FlatfieldStream<unsigned char>(in_path, out_path, dark->GetBufferPointer(), gain, slab_planes, verbose, compression_scheme);
+    else if (bit_depth == 16)
+      streamed = FlatfieldStream<unsigned short>(in_path, out_path, dark->GetBufferPointer(), gain, slab_planes, verbose, compression_scheme);
+    else
+      streamed = FlatfieldStream<float>(in_path, out_path, dark->GetBufferPointer(), gain, slab_planes, verbose, compression_scheme);
+    if (!streamed) {
+      std::cerr << "flatfield: streaming flatfield failed" << std::endl;
+      return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+  }
+
+  // read data
+  kImageType::Pointer img = ReadImageFile<kImageType>(in_path, false, false);
+
   // set spacing
   kImageType::SpacingType img_spacing = img->GetSpacing();
   if (xy_res > 0.0) {
@@ -179,6 +228,10 @@ int main(int argc, char** argv) {
 
   // flatfield
   kImageType::Pointer corrected_img = FlatfieldCorrection(img, dark, n_img, verbose);
+  if (corrected_img == nullptr) {
+    std::cerr << "flatfield: dark and N images must match the size of the input slices" << std::endl;
+    return EXIT_FAILURE;
+  }
 
   img_spacing[0] = 1.0;
   img_spacing[1] = 1.0;
@@ -189,15 +242,15 @@ int main(int argc, char** argv) {
   if (bit_depth == 8) {
     using PixelTypeOut = unsigned char;
     using ImageTypeOut = itk::Image<PixelTypeOut, kDimensions>;
-    WriteImageFile<kImageType,ImageTypeOut>(corrected_img, out_path, false, true, false);
+    WriteImageFile<kImageType,ImageTypeOut>(corrected_img, out_path, false, true, false, "", compression_scheme);
   } else if (bit_depth == 16) {
     using PixelTypeOut = unsigned short;
     using ImageTypeOut = itk::Image<PixelTypeOut, kDimensions>;
-    WriteImageFile<kImageType,ImageTypeOut>(corrected_img, out_path, false, true, false);
+    WriteImageFile<kImageType,ImageTypeOut>(corrected_img, out_path, false, true, false, "", compression_scheme);
   } else if (bit_depth == 32) {
     using PixelTypeOut = float;
     using ImageTypeOut = itk::Image<PixelTypeOut, kDimensions>;
-    WriteImageFile<kImageType,ImageTypeOut>(corrected_img, out_path, false, true, false);
+    WriteImageFile<kImageType,ImageTypeOut>(corrected_img, out_path, false, true, false, "", compression_scheme);
   } else {
     std::cerr << "flatfield: unknown bit depth" << std::endl;
     return EXIT_FAILURE;
@@ -3,162 +3,191 @@
 #define DECON_VERSION "AIC Decon version 0.1.0"
 
 #include "defines.h"
+#include "gain.h"
+#include "parallel.h"
+#include "pipeline.h"
+#include "stream.h"
 #include "utils.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <thread>
+#include <vector>
 #include <itkImage.h>
-#include "itkSubtractImageFilter.h"
-#include "itkDivideImageFilter.h"
-#include "itkExtractImageFilter.h"
-#include "itkPasteImageFilter.h"
-#include "itkUnaryFunctorImageFilter.h"
 #include "itkMinimumMaximumImageFilter.h"
 #include <itkMultiThreaderBase.h>
 
 #define FLATFIELD_VERSION "AIC flatfield correction version 0.1.0"
 
-// Define a functor that clamps values to 0
-namespace itk
+// Corrects count pixels of one slice in place as max(I - dark, 0) / n, in one pass with no
+// temporaries. It divides like DivideImageFilter, including the maximum value it gives where
+// n is (almost) zero, so results match the per-slice ITK filter chain exactly.
+template <class TPixel>
+void FlatfieldSlice(TPixel *slice, const TPixel *dark, const TPixel *n, size_t count)
 {
-    namespace Functor
+    const TPixel zero_divisor = static_cast<TPixel>(0.1 * std::numeric_limits<TPixel>::epsilon());
+    for (size_t i = 0; i < count; ++i)
     {
-        template<typename TInput, typename TOutput>
-        class ClampToZero
-        {
-        public:
-            ClampToZero() {}
-            ~ClampToZero() {}
-
-            bool operator!=(const ClampToZero &) const
-            {
-                return false;
-            }
-
-            bool operator==(const ClampToZero &other) const
-            {
-                return !(*this != other);
-            }
-
-            inline TOutput operator()(const TInput &x) const
-            {
-                return static_cast<TOutput>((x < 0) ? 0 : x);
-            }
-        };
+        const TPixel difference = slice[i] - dark[i];
+        const TPixel clamped = (difference < 0) ? 0 : difference;
+        slice[i] = (std::abs(n[i]) > zero_divisor) ? static_cast<TPixel>(clamped / n[i]) : std::numeric_limits<TPixel>::max();
     }
 }
 
-kImageType::Pointer FlatfieldCorrection(kImageType::Pointer img, kSliceType::Pointer sub, kSliceType::Pointer div, bool verbose=false)
+// Flatfield corrects every slice of img in place with the dark image sub and the normalized
+// flatfield div, slices in parallel. Returns img, or nullptr if the slice sizes differ.
+template <class TImage>
+itk::SmartPointer<TImage> FlatfieldCorrection(itk::SmartPointer<TImage> img, typename itk::Image<typename TImage::PixelType, 2>::Pointer sub, typename itk::Image<typename TImage::PixelType, 2>::Pointer div, bool verbose=false)
 {
-    kImageType::Pointer outputStack = kImageType::New();
-    outputStack->SetRegions(img->GetLargestPossibleRegion());
-    outputStack->SetSpacing(img->GetSpacing());
-    outputStack->SetOrigin(img->GetOrigin());
-    outputStack->SetDirection(img->GetDirection());
-    outputStack->Allocate();
-    outputStack->FillBuffer(0); // Initialize with zeros
-
-    // Prepare to iterate over the slices in the stack
-    kImageType::RegionType stackRegion = img->GetLargestPossibleRegion();
-    kImageType::SizeType stackSize = stackRegion.GetSize();
-    
-    for (unsigned int i = 0; i < stackSize[2]; ++i)
-    {
-        // Define the slice to extract
-        kImageType::IndexType start = stackRegion.GetIndex();
-        start[2] = i;
+    using PixelType = typename TImage::PixelType;
 
-        kImageType::SizeType size = stackSize;
-        size[2] = 0;
+    const typename TImage::SizeType size = img->GetLargestPossibleRegion().GetSize();
+    const typename itk::Image<PixelType, 2>::SizeType sub_size = sub->GetLargestPossibleRegion().GetSize();
+    const typename itk::Image<PixelType, 2>::SizeType div_size = div->GetLargestPossibleRegion().GetSize();
+    if (sub_size[0] != size[0] || sub_size[1] != size[1] || div_size[0] != size[0] || div_size[1] != size[1])
+    {
+        std::cerr << "Flatfield images are " << sub_size[0] << "x" << sub_size[1] << " and " << div_size[0] << "x" << div_size[1]
+                  << " but the slices are " << size[0] << "x" << size[1] << std::endl;
+        return nullptr;
+    }
 
-        kImageType::RegionType desiredRegion(start, size);
+    const size_t slice_size = size[0] * size[1];
+    PixelType *data = img->GetBufferPointer();
+    const PixelType *dark = sub->GetBufferPointer();
+    const PixelType *n = div->GetBufferPointer();
+    const unsigned int threads = itk::MultiThreaderBase::GetGlobalDefaultNumberOfThreads();
 
-        using ExtractFilterType = itk::ExtractImageFilter<kImageType, kSliceType>;
-        ExtractFilterType::Pointer extractFilter = ExtractFilterType::New();
-        extractFilter->SetExtractionRegion(desiredRegion);
-        extractFilter->SetInput(img);
-        extractFilter->SetDirectionCollapseToSubmatrix();
-        try
-        {
-            extractFilter->Update();
-        }
-        catch (itk::ExceptionObject &err)
-        {
-            std::cerr << "extractFilter ExceptionObject caught: " << err << std::endl;
-            throw;
-        }
-        kSliceType::Pointer currentSlice = extractFilter->GetOutput();
-
-        // Subtract the single slice from the current slice
-        using SubtractFilterType = itk::SubtractImageFilter<kSliceType, kSliceType, kSliceType>;
-        SubtractFilterType::Pointer subtractFilter = SubtractFilterType::New();
-        subtractFilter->SetInput1(currentSlice);
-        subtractFilter->SetInput2(sub);
-        try
-        {
-            subtractFilter->Update();
-        }
-        catch (itk::ExceptionObject &err)
-        {
-            std::cerr << "subtractFilter ExceptionObject caught: " << err << std::endl;
-            throw;
-        }
+    if (verbose)
+        std::cout << "Flatfield correcting " << size[2] << " slices with " << threads << " threads" << std::endl;
 
-        kSliceType::Pointer subtractedSlice = subtractFilter->GetOutput();
+    ParallelFor(size[2], threads, [&](size_t begin, size_t end) {
+        for (size_t z = begin; z < end; ++z)
+            FlatfieldSlice(data + z * slice_size, dark, n, slice_size);
+    }, 1);
 
-        // Clamp the subtracted values at 0
-        using ClampFilterType = itk::UnaryFunctorImageFilter<kSliceType, kSliceType, itk::Functor::ClampToZero<kPixelType, kPixelType>>;
-        ClampFilterType::Pointer clampFilter = ClampFilterType::New();
-        clampFilter->SetInput(subtractedSlice);
+    return img;
+}
 
-        try
-        {
-            clampFilter->Update();
-        }
-        catch (itk::ExceptionObject &err)
-        {
-            std::cerr << "ExceptionObject caught: " << err << std::endl;
-            throw;
-        }
+// Corrects count pixels of one slice in place as max(I - dark, 0) * inverse, then saturates
+// the pixels the gain map lists, in one pass with no temporaries
+template <class TPixel>
+void FlatfieldSliceInverse(TPixel *slice, const TPixel *dark, const TPixel *inverse, const std::vector<size_t> &saturated, size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        const TPixel difference = slice[i] - dark[i];
+        const TPixel clamped = (difference < 0) ? 0 : difference;
+        slice[i] = clamped * inverse[i];
+    }
+    for (size_t i : saturated)
+        slice[i] = std::numeric_limits<TPixel>::max();
+}
 
-        kSliceType::Pointer clampedSlice = clampFilter->GetOutput();
+// Flatfield corrects a TIFF stack slab by slab, so peak memory is a few slabs of planes
+// whatever the depth of the stack. Pages are read and written unscaled, like the in-memory
+// path, and reading, correcting and writing run as concurrent pipeline stages. The gain map
+// multiplies by the reciprocal of N, which can differ from dividing by N in the last bit.
+template <class TPixelOut>
+bool FlatfieldStream(const std::string &in_path, const std::string &out_path, const kPixelType *dark, const GainMap &gain, size_t slab_planes, bool verbose=false, uint16_t compression=COMPRESSION_NONE)
+{
+    TiffPageReader reader;
+    if (!reader.Open(in_path))
+    {
+        std::cerr << "Unable to open " << in_path << " for streaming, only single channel, stripped TIFF stacks can be streamed" << std::endl;
+        return false;
+    }
 
-        using DivideFilterType = itk::DivideImageFilter<kSliceType, kSliceType, kSliceType>;
-        DivideFilterType::Pointer divideFilter = DivideFilterType::New();
-        divideFilter->SetInput1(clampedSlice);
-        divideFilter->SetInput2(div);
+    const size_t nx = reader.Width(), ny = reader.Height(), nz = reader.Pages();
+    const size_t plane_size = nx * ny;
+    if (gain.Width() != nx || gain.Height() != ny)
+    {
+        std::cerr << "Flatfield images are " << gain.Width() << "x" << gain.Height() << " but the slices are " << nx << "x" << ny << std::endl;
+        return false;
+    }
+    slab_planes = std::max<size_t>(1, slab_planes);
 
-        try
-        {
-            divideFilter->Update();
-        }
-        catch (itk::ExceptionObject &err)
-        {
-            std::cerr << "ExceptionObject caught: " << err << std::endl;
-            throw;
-        }
+    if (verbose)
+        std::cout << "Streaming " << nz << " planes of " << nx << " x " << ny << " in slabs of " << slab_planes << std::endl;
 
-        kSliceType::Pointer dividedSlice2D = divideFilter->GetOutput();
+    TiffPageWriter<TPixelOut> writer;
+    if (!writer.Open(out_path, nx, ny, nz, {1.0, 1.0, 1.0}, false, "", compression))
+    {
+        std::cerr << "Unable to open " << out_path << " for writing" << std::endl;
+        return false;
+    }
 
-        kImageType::Pointer dividedSlice = Convert2DImageTo3D<kPixelType>(dividedSlice2D);
+    struct Slab
+    {
+        size_t first;
+        size_t planes;
+        std::vector<kPixelType> data;
+    };
 
-        // Paste the clamped slice into the new output stack
-        using PasteFilterType = itk::PasteImageFilter<kImageType, kImageType>;
-        PasteFilterType::Pointer pasteFilter = PasteFilterType::New();
-        pasteFilter->SetSourceImage(dividedSlice);
-        pasteFilter->SetDestinationImage(outputStack);
-        pasteFilter->SetSourceRegion(dividedSlice->GetLargestPossibleRegion());
-        pasteFilter->SetDestinationIndex(start);
+    BoundedQueue<Slab> read_queue(2);
+    BoundedQueue<Slab> write_queue(2);
+    std::atomic<bool> failed(false);
 
-        try
+    std::thread read_stage([&]() {
+        for (size_t first = 0; first < nz && !failed; first += slab_planes)
         {
-            pasteFilter->Update();
+            Slab slab;
+            slab.first = first;
+            slab.planes = std::min(slab_planes, nz - first);
+            slab.data.resize(slab.planes * plane_size);
+            for (size_t p = 0; p < slab.planes && !failed; ++p)
+            {
+                if (!reader.ReadPage(first + p, slab.data.data() + p * plane_size, false))
+                {
+                    std::cerr << "Unable to read page " << first + p << " of " << in_path << std::endl;
+                    failed = true;
+                }
+            }
+            if (failed || !read_queue.Push(std::move(slab)))
+                break;
         }
-        catch (itk::ExceptionObject &err)
+        read_queue.Close();
+    });
+
+    std::thread write_stage([&]() {
+        Slab slab;
+        while (write_queue.Pop(slab))
         {
-            std::cerr << "ExceptionObject caught: " << err << std::endl;
-            throw;
+            for (size_t p = 0; p < slab.planes; ++p)
+            {
+                if (!writer.WritePage(slab.data.data() + p * plane_size, false))
+                {
+                    std::cerr << "Unable to write page " << slab.first + p << " of " << out_path << std::endl;
+                    failed = true;
+                    write_queue.Close();
+                    read_queue.Close();
+                    return;
+                }
+            }
+            if (verbose)
+                std::cout << "Corrected planes " << slab.first + 1 << "-" << slab.first + slab.planes << "/" << nz << std::endl;
         }
+    });
+
+    // slabs are corrected in place on the calling thread, in parallel over their planes
+    const unsigned int threads = itk::MultiThreaderBase::GetGlobalDefaultNumberOfThreads();
+    Slab slab;
+    while (read_queue.Pop(slab))
+    {
+        ParallelFor(slab.planes, threads, [&](size_t begin, size_t end) {
+            for (size_t p = begin; p < end; ++p)
+                FlatfieldSliceInverse(slab.data.data() + p * plane_size, dark, gain.Inverse(), gain.Saturated(), plane_size);
+        }, 1);
 
-        outputStack = pasteFilter->GetOutput();
+        if (!write_queue.Push(std::move(slab)))
+            break;
     }
+    write_queue.Close();
+
+    read_stage.join();
+    write_stage.join();
 
-    return outputStack;
-}
\ No newline at end of file
+    return writer.Close() && !failed;
+}
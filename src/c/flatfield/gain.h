@@ -0,0 +1,47 @@
+#pragma once
+
+#include "defines.h"
+#include <cmath>
+#include <limits>
+#include <vector>
+
+// Reciprocal of the normalized flatfield N, so correcting a plane multiplies instead of
+// dividing. Where N is (almost) zero, DivideImageFilter gives the maximum value; those pixels
+// get a reciprocal of zero and are listed so the correction can saturate them.
+class GainMap
+{
+public:
+    size_t Width() const { return width_; }
+    size_t Height() const { return height_; }
+    const kPixelType *Inverse() const { return inverse_.data(); }
+    const std::vector<size_t> &Saturated() const { return saturated_; }
+
+    // Computes the map from width x height pixels of N
+    void Compute(const kPixelType *n, size_t width, size_t height)
+    {
+        const kPixelType zero_divisor = static_cast<kPixelType>(0.1 * std::numeric_limits<kPixelType>::epsilon());
+
+        width_ = width;
+        height_ = height;
+        inverse_.resize(width * height);
+        for (size_t i = 0; i < inverse_.size(); ++i)
+            inverse_[i] = (std::abs(n[i]) > zero_divisor) ? static_cast<kPixelType>(1.0 / n[i]) : kPixelType(0);
+        FindSaturated();
+    }
+
+private:
+    void FindSaturated()
+    {
+        saturated_.clear();
+        for (size_t i = 0; i < inverse_.size(); ++i)
+        {
+            if (inverse_[i] == kPixelType(0))
+                saturated_.push_back(i);
+        }
+    }
+
+    size_t width_ = 0;
+    size_t height_ = 0;
+    std::vector<kPixelType> inverse_;
+    std::vector<size_t> saturated_;
+};
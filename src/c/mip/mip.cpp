@@ -4,6 +4,12 @@
 #include "reader.h"
 #include "writer.h"
 #include "resampler.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
 #include <boost/program_options.hpp>
 
 namespace po = boost::program_options;
@@ -16,12 +22,17 @@ int main(int argc, char** argv) {
   float xy_res = UNSET_FLOAT;
   float z_res = UNSET_FLOAT;
   unsigned int bit_depth = UNSET_UNSIGNED_INT;
+  std::string compression = "";
   unsigned int threadnum = UNSET_UNSIGNED_INT;
+  unsigned int workers = UNSET_UNSIGNED_INT;
+  std::vector<std::string> projection_names;
+  std::vector<float> kymograph_line;
+  std::string input_list = "";
   bool overwrite = UNSET_BOOL;
   bool verbose = UNSET_BOOL;
 
   // declare the supported options
-  po::options_description visible_opts("usage: mip [options] path\n\nAllowed options");
+  po::options_description visible_opts("usage: mip [options] path [path ...]\n\nAllowed options");
   visible_opts.add_options()
       ("help,h", "display this help message")
       ("x-axis,x", po::value<bool>(&x_axis)->default_value(false)->implicit_value(true)->zero_tokens(), "generate x-axis projection")
@@ -30,8 +41,13 @@ int main(int argc, char** argv) {
       ("xy-rez,p", po::value<float>(&xy_res)->default_value(0.104f), "x/y resolution (um/px)")
       ("z-rez,q", po::value<float>(&z_res)->default_value(0.104f), "z resolution (um/px)")
       ("output,o", po::value<std::string>()->required(),"output file path")
+      ("input-list,l", po::value<std::string>(&input_list)->default_value(""),"file listing input paths, one per line")
       ("bit-depth,b", po::value<unsigned int>(&bit_depth)->default_value(16),"bit depth (8, 16, or 32) of output image")
+      ("compression", po::value<std::string>(&compression)->default_value("none"),"lossless compression of output TIFFs (none, lzw, deflate, or zstd)")
       ("thread,t", po::value<unsigned int>(&threadnum)->default_value(1),"number of threads")
+      ("workers", po::value<unsigned int>(&workers)->default_value(1),"number of time points projected in parallel, sharing the threads")
+      ("kymograph", po::value<std::vector<float>>(&kymograph_line)->multitoken(),"x0 y0 x1 y1 of a line in the z projection to also write a kymograph of")
+      ("projection,m", po::value<std::vector<std::string>>(&projection_names)->multitoken()->default_value(std::vector<std::string>{"max"}, "max"), "projections to compute in one pass: max, min, sum, mean, and/or std")
       ("overwrite,w", po::value<bool>(&overwrite)->default_value(false)->implicit_value(true)->zero_tokens(), "overwrite output if it exists")
       ("verbose,v", po::value<bool>(&verbose)->default_value(false)->implicit_value(true)->zero_tokens(), "display progress and debug information")
       ("version", "display the version number")
@@ -39,11 +55,11 @@ int main(int argc, char** argv) {
 
   po::options_description hidden_opts;
   hidden_opts.add_options()
-    ("input", po::value<std::string>()->required(), "input file path")
+    ("input", po::value<std::vector<std::string>>()->multitoken(), "input file paths or wildcard patterns")
   ;
 
   po::positional_options_description positional_opts; 
-  positional_opts.add("input", 1);
+  positional_opts.add("input", -1);
 
   po::options_description all_opts;
   all_opts.add(visible_opts).add(hidden_opts);
@@ -55,7 +71,7 @@ int main(int argc, char** argv) {
 
     // print help message
     if (varsmap.count("help") || (argc == 1)) {
-      std::cerr << "mip: generates a maximum intensity projection along the specified axes\n";
+      std::cerr << "mip: generates intensity projections along the specified axes\n";
       std::cerr << visible_opts << std::endl;
       return EXIT_FAILURE;
     }
@@ -79,12 +95,30 @@ int main(int argc, char** argv) {
     return EXIT_FAILURE;
   }
 
-  // check files
-  const char* in_path = varsmap["input"].as<std::string>().c_str();
-  if (!IsFile(in_path)) {
-    std::cerr << "mip: input path is not a file" << std::endl;
+  // check files, several inputs are the time points of a series
+  std::vector<std::string> in_paths;
+  if (varsmap.count("input")) {
+    in_paths = ExpandPaths(varsmap["input"].as<std::vector<std::string>>());
+  }
+  if (!input_list.empty()) {
+    if (!IsFile(input_list.c_str())) {
+      std::cerr << "mip: input list path is not a file" << std::endl;
+      return EXIT_FAILURE;
+    }
+    std::vector<std::string> listed = ExpandPaths(ReadPathList(input_list));
+    in_paths.insert(in_paths.end(), listed.begin(), listed.end());
+  }
+  if (in_paths.empty()) {
+    std::cerr << "mip: no input files" << std::endl;
     return EXIT_FAILURE;
   }
+  for (const std::string &in_path : in_paths) {
+    if (!IsFile(in_path.c_str())) {
+      std::cerr << "mip: input path is not a file: " << in_path << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+  const bool series = (in_paths.size() > 1);
   const char* out_path = varsmap["output"].as<std::string>().c_str();
   if (IsFile(out_path)) {
     if (!overwrite) {
@@ -103,6 +137,13 @@ int main(int argc, char** argv) {
     return EXIT_FAILURE;
   }
 
+  // check compression
+  uint16_t compression_scheme = COMPRESSION_NONE;
+  if (!ParseTiffCompression(compression, compression_scheme)) {
+    std::cerr << "mip: compression must be none, lzw, deflate, or zstd, and supported by the TIFF library" << std::endl;
+    return EXIT_FAILURE;
+  }
+
   // check at least one axis is true
   if (!x_axis & !y_axis & !z_axis)
   {
@@ -110,70 +151,203 @@ int main(int argc, char** argv) {
     return EXIT_FAILURE;
   }
 
+  // check projections
+  std::vector<ProjectionMode> modes;
+  for (const std::string &name : projection_names)
+  {
+    ProjectionMode mode;
+    if (!ParseProjectionMode(name, mode))
+    {
+      std::cerr << "mip: projection must be max, min, sum, mean, or std" << std::endl;
+      return EXIT_FAILURE;
+    }
+    if (std::find(modes.begin(), modes.end(), mode) == modes.end())
+      modes.push_back(mode);
+  }
+
+  // check kymograph line
+  const bool kymograph = !kymograph_line.empty();
+  if (kymograph && kymograph_line.size() != 4)
+  {
+    std::cerr << "mip: kymograph line must be given as x0 y0 x1 y1" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  if (workers == 0)
+  {
+    std::cerr << "mip: number of workers must be at least 1" << std::endl;
+    return EXIT_FAILURE;
+  }
+
   // print parameters
   if (verbose) {
     std::cout << "\nInput Parameters\n";
     std::cout << "X-axis = " << x_axis << "\n";
     std::cout << "Y-axis = " << y_axis << "\n";
     std::cout << "Z-axis = " << z_axis << "\n";
-    std::cout << "Input Path = " << in_path << "\n";
+    std::cout << "Projections =";
+    for (const std::string &name : projection_names)
+      std::cout << " " << name;
+    std::cout << "\n";
+    std::cout << "Input Paths =";
+    for (const std::string &in_path : in_paths)
+      std::cout << " " << in_path;
+    std::cout << "\n";
+    if (kymograph)
+      std::cout << "Kymograph = " << kymograph_line[0] << " " << kymograph_line[1] << " " << kymograph_line[2] << " " << kymograph_line[3] << "\n";
+    if (series)
+      std::cout << "Workers = " << workers << "\n";
     std::cout << "Output Path = " << out_path << "\n";
     std::cout << "Overwrite = " << overwrite << "\n";
+    std::cout << "Compression = " << compression << "\n";
     std::cout << "Bit Depth = " << bit_depth << std::endl;
   }
 
   // set thread number
   itk::MultiThreaderBase::SetGlobalDefaultNumberOfThreads(threadnum);
 
-  // mip
-  kImageType::Pointer img = ReadImageFile<kImageType>(in_path);
-
-  bool axes[] = {x_axis, y_axis, z_axis};
+  // the kymograph is sampled from the z projection, which is computed even if not written
+  const std::array<bool, 3> axes = {{x_axis, y_axis, z_axis}};
+  const std::array<bool, 3> project_axes = {{x_axis, y_axis, z_axis || kymograph}};
+  const std::array<float, 4> line = kymograph ? std::array<float, 4>{{kymograph_line[0], kymograph_line[1], kymograph_line[2], kymograph_line[3]}} : std::array<float, 4>();
   std::string labels[] = {"_x", "_y", "_z"};
+  using ProjectionType = itk::Image<kPixelType, 2>;
 
-  // resample the image so the voxels are cubes before making the projections
-  kImageType::SpacingType img_spacing;
+  // projections are made on the native grid, and only the x and y projections, which
+  // span z, are resampled so their pixels are square
+  auto finish_projection = [&](const ImageProjections &projections, unsigned int axis, size_t m) {
+    ProjectionType::Pointer mip_img = ProjectionToImage(projections.projections[axis][m], projections.width[axis], projections.height[axis]);
+    ProjectionType::SpacingType mip_spacing;
 
-  img_spacing[0] = xy_res;
-  img_spacing[1] = xy_res;
-  img_spacing[2] = z_res;
-  img->SetSpacing(img_spacing);
+    if (axis < 2 && z_res != xy_res)
+    {
+      mip_spacing[0] = xy_res;
+      mip_spacing[1] = z_res;
+      mip_img->SetSpacing(mip_spacing);
+
+      ProjectionType::SpacingType square_spacing;
+      square_spacing[0] = xy_res;
+      square_spacing[1] = xy_res;
+      mip_img = Resampler(mip_img, square_spacing, verbose && !series);
+    }
+
+    mip_spacing[0] = 1.0;
+    mip_spacing[1] = 1.0;
+    mip_img->SetSpacing(mip_spacing);
+    return mip_img;
+  };
+
+  // writes a 2D projection or kymograph
+  auto write_image = [&](ProjectionType::Pointer mip_img, const std::string &path) {
+    if (bit_depth == 8) {
+        using PixelTypeOut = unsigned char;
+        using ImageTypeOut = itk::Image<PixelTypeOut, 2>;
+        WriteImageFile<ProjectionType,ImageTypeOut>(mip_img, path, verbose, false, true, "", compression_scheme);
+    } else if (bit_depth == 16) {
+        using PixelTypeOut = unsigned short;
+        using ImageTypeOut = itk::Image<PixelTypeOut, 2>;
+        WriteImageFile<ProjectionType,ImageTypeOut>(mip_img, path, verbose, false, true, "", compression_scheme);
+    } else {
+        using PixelTypeOut = float;
+        using ImageTypeOut = itk::Image<PixelTypeOut, 2>;
+        WriteImageFile<ProjectionType,ImageTypeOut>(mip_img, path, verbose, false, true, "", compression_scheme);
+    }
+  };
+
+  // project every time point, several at a time when there are workers to spare, reading
+  // each file once; only the 2D projections of all time points are kept
+  std::vector<ImageProjections> timepoints(in_paths.size());
+  const unsigned int worker_count = std::min<size_t>(workers, in_paths.size());
+  const unsigned int worker_threads = std::max(1u, threadnum / worker_count);
+  std::atomic<size_t> next_timepoint(0);
+  std::atomic<bool> failed(false);
+
+  auto project_timepoints = [&]() {
+    for (size_t t = next_timepoint++; t < in_paths.size() && !failed; t = next_timepoint++)
+    {
+      if (!ProjectImageFile(in_paths[t], project_axes, modes, worker_threads, timepoints[t], verbose))
+      {
+        std::cerr << "mip: unable to read " << in_paths[t] << std::endl;
+        failed = true;
+      }
+    }
+  };
+
+  std::vector<std::thread> pool;
+  for (unsigned int w = 1; w < worker_count; ++w)
+    pool.emplace_back(project_timepoints);
+  project_timepoints();
+  for (std::thread &worker : pool)
+    worker.join();
+
+  if (failed)
+    return EXIT_FAILURE;
 
-  if (z_res != xy_res)
+  for (const ImageProjections &projections : timepoints)
   {
-    img = Resampler(img, xy_res, verbose);
+    if (projections.width != timepoints[0].width || projections.height != timepoints[0].height)
+    {
+      std::cerr << "mip: all time points must have the same size" << std::endl;
+      return EXIT_FAILURE;
+    }
   }
 
   for (unsigned int i = 0; i < 3; ++i) 
   {
-    if (axes[i])
+    if (!axes[i])
+      continue;
+
+    for (size_t m = 0; m < modes.size(); ++m)
+    {
+      std::string axis_out_path = AppendPath(out_path, ProjectionLabel(modes[m]) + labels[i]);
+      if (!series)
+      {
+        write_image(finish_projection(timepoints[0], i, m), axis_out_path);
+        continue;
+      }
+
+      // one page per time point
+      std::vector<std::vector<kPixelType>> frames;
+      ProjectionType::SizeType frame_size;
+      for (const ImageProjections &projections : timepoints)
+      {
+        ProjectionType::Pointer frame = finish_projection(projections, i, m);
+        frame_size = frame->GetLargestPossibleRegion().GetSize();
+        frames.emplace_back(frame->GetBufferPointer(), frame->GetBufferPointer() + frame_size[0] * frame_size[1]);
+      }
+
+      if (verbose)
+        std::cout << "Writing " << frames.size() << " time points to " << axis_out_path << std::endl;
+
+      bool written = false;
+      if (bit_depth == 8)
+        written = WriteProjectionSeries<unsigned char>(axis_out_path, frames, frame_size[0], frame_size[1], compression_scheme);
+      else if (bit_depth == 16)
+        written = WriteProjectionSeries<unsigned short>(axis_out_path, frames, frame_size[0], frame_size[1], compression_scheme);
+      else
+        written = WriteProjectionSeries<float>(axis_out_path, frames, frame_size[0], frame_size[1], compression_scheme);
+      if (!written)
+      {
+        std::cerr << "mip: unable to write " << axis_out_path << std::endl;
+        return EXIT_FAILURE;
+      }
+    }
+  }
+
+  // kymographs have one row per time point, sampled along the line in the z projection
+  if (kymograph)
+  {
+    for (size_t m = 0; m < modes.size(); ++m)
     {
-        std::string axis_out_path = AppendPath(out_path, labels[i]);
-        using ProjectionType = itk::Image<kPixelType, 2>;
-        ProjectionType::Pointer mip_img = MaxIntensityProjection(img, i, verbose);
-        ProjectionType::SpacingType mip_spacing;
-
-        mip_spacing[0] = 1.0;
-        mip_spacing[1] = 1.0;
-        mip_img->SetSpacing(mip_spacing);
-
-        // write file
-        if (bit_depth == 8) {
-            using PixelTypeOut = unsigned char;
-            using ImageTypeOut = itk::Image<PixelTypeOut, 2>;
-            WriteImageFile<ProjectionType,ImageTypeOut>(mip_img, axis_out_path, verbose, false);
-        } else if (bit_depth == 16) {
-            using PixelTypeOut = unsigned short;
-            using ImageTypeOut = itk::Image<PixelTypeOut, 2>;
-            WriteImageFile<ProjectionType,ImageTypeOut>(mip_img, axis_out_path, verbose, false);
-        } else if (bit_depth == 32) {
-            using PixelTypeOut = float;
-            using ImageTypeOut = itk::Image<PixelTypeOut, 2>;
-            WriteImageFile<ProjectionType,ImageTypeOut>(mip_img, axis_out_path, verbose, false);
-        } else {
-            std::cerr << "mip: unknown bit depth" << std::endl;
-            return EXIT_FAILURE;
-        }
+      std::vector<kPixelType> rows;
+      size_t row_length = 0;
+      for (const ImageProjections &projections : timepoints)
+      {
+        std::vector<kPixelType> row = SampleLine(projections.projections[2][m], projections.width[2], projections.height[2], line);
+        row_length = row.size();
+        rows.insert(rows.end(), row.begin(), row.end());
+      }
+      write_image(ProjectionToImage(rows, row_length, timepoints.size()), AppendPath(out_path, ProjectionLabel(modes[m]) + "_kymograph"));
     }
   }
 
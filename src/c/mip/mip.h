@@ -3,6 +3,20 @@
 #define MIP_VERSION "AIC MIP version 0.1.0"
 
 #include "defines.h"
+#include "parallel.h"
+#include "pipeline.h"
+#include "reader.h"
+#include "stream.h"
+#include "utils.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <limits>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
 #include <itkImage.h>
 #include <itkImageBase.h>
 
@@ -10,19 +24,21 @@
 
 #include <itkMultiThreaderBase.h>
 
-itk::Image<kPixelType, 2>::Pointer MaxIntensityProjection(kImageType::Pointer img, unsigned int axis, bool verbose=false)
+template <class TImage>
+typename itk::Image<typename TImage::PixelType, 2>::Pointer MaxIntensityProjection(itk::SmartPointer<TImage> img, unsigned int axis, bool verbose=false)
 {
-  using FilterType = itk::MaximumProjectionImageFilter<kImageType, itk::Image<kPixelType, 2>>;
+  using ProjectionType = itk::Image<typename TImage::PixelType, 2>;
+  using FilterType = itk::MaximumProjectionImageFilter<TImage, ProjectionType>;
   // using FilterType = itk::MaximumProjectionImageFilter<kImageType, kImageType>;
 
-  FilterType::Pointer filter = FilterType::New();
+  typename FilterType::Pointer filter = FilterType::New();
   filter->SetInput(img);
   filter->SetProjectionDimension(axis);
   filter->Update();
-  itk::Image<kPixelType, 2>::Pointer img_out = filter->GetOutput();
+  typename ProjectionType::Pointer img_out = filter->GetOutput();
 
-  kImageType::SpacingType spacing_in = img->GetSpacing();
-  itk::Image<kPixelType, 2>::SpacingType spacing_out;
+  typename TImage::SpacingType spacing_in = img->GetSpacing();
+  typename ProjectionType::SpacingType spacing_out;
 
   // assuming isometric dimensions
   spacing_out[0] = spacing_in[0]; //TODO: could be dangerous to assume
@@ -31,3 +47,455 @@ itk::Image<kPixelType, 2>::Pointer MaxIntensityProjection(kImageType::Pointer im
 
   return img_out;
 }
+
+enum class ProjectionMode
+{
+  kMax,
+  kMin,
+  kSum,
+  kMean,
+  kStd // population standard deviation along the projected axis
+};
+
+bool ParseProjectionMode(const std::string &name, ProjectionMode &mode)
+{
+  if (name == "max")
+    mode = ProjectionMode::kMax;
+  else if (name == "min")
+    mode = ProjectionMode::kMin;
+  else if (name == "sum")
+    mode = ProjectionMode::kSum;
+  else if (name == "mean")
+    mode = ProjectionMode::kMean;
+  else if (name == "std")
+    mode = ProjectionMode::kStd;
+  else
+    return false;
+  return true;
+}
+
+// File name label of a projection; maximum projections keep the plain axis labels
+std::string ProjectionLabel(ProjectionMode mode)
+{
+  switch (mode)
+  {
+  case ProjectionMode::kMin:
+    return "_min";
+  case ProjectionMode::kSum:
+    return "_sum";
+  case ProjectionMode::kMean:
+    return "_mean";
+  case ProjectionMode::kStd:
+    return "_std";
+  default:
+    return "";
+  }
+}
+
+// Projects a volume along any of x, y and z with any set of modes in a single traversal.
+// The volume arrives as batches of z planes, so it can be fed a whole image or a stream of
+// pages, in its native pixel type T. Threads own ranges of rows, which they sweep in blocks
+// of a few rows through every plane of a batch so the z projection rows stay in cache. The
+// x and z projections of a row range belong to one thread; the y projections are reduced over
+// rows, so every thread keeps partial y projections for the batch that are merged afterwards.
+// Results are laid out like MaximumProjectionImageFilter output: x is y by z, y is x by z and
+// z is x by y.
+template <class T>
+class ProjectionAccumulator
+{
+public:
+  // planes per batch, which bounds the partial y projections kept by every thread
+  static constexpr size_t kPlaneBatch = 32;
+
+  ProjectionAccumulator(size_t nx, size_t ny, size_t nz, const std::array<bool, 3> &axes, const std::vector<ProjectionMode> &modes, unsigned int threads)
+    : size_{nx, ny, nz}, axes_(axes), threads_(threads)
+  {
+    for (ProjectionMode mode : modes)
+    {
+      need_max_ |= (mode == ProjectionMode::kMax);
+      need_min_ |= (mode == ProjectionMode::kMin);
+      need_sum_ |= (mode == ProjectionMode::kSum || mode == ProjectionMode::kMean || mode == ProjectionMode::kStd);
+      need_squares_ |= (mode == ProjectionMode::kStd);
+    }
+
+    for (unsigned int axis = 0; axis < 3; ++axis)
+    {
+      if (axes_[axis])
+        Allocate(sums_[axis], Width(axis) * Height(axis));
+    }
+  }
+
+  // size of the projection along axis
+  size_t Width(unsigned int axis) const { return (axis == 0) ? size_[1] : size_[0]; }
+  size_t Height(unsigned int axis) const { return (axis == 2) ? size_[1] : size_[2]; }
+
+  // Adds count consecutive x-fastest planes starting at plane z_first
+  void AddPlanes(const T *planes, size_t z_first, size_t count)
+  {
+    const size_t plane_size = size_[0] * size_[1];
+    for (size_t p = 0; p < count; p += kPlaneBatch)
+      AddBatch(planes + p * plane_size, z_first + p, (count - p < kPlaneBatch) ? count - p : kPlaneBatch);
+  }
+
+  // Projection along axis in the working precision, scaled like ReadImageFile scales T
+  std::vector<kPixelType> Projection(unsigned int axis, ProjectionMode mode) const
+  {
+    double input_min, input_max, output_min, output_max;
+    GetRange<T>(input_min, input_max);
+    GetRange<kPixelType>(output_min, output_max);
+    double scale = (output_max - output_min) / (input_max - input_min);
+    double shift = output_min - input_min * scale;
+    if (std::is_same<T, kPixelType>::value)
+    {
+      scale = 1.0;
+      shift = 0.0;
+    }
+
+    const Sums &sums = sums_[axis];
+    const double n = double(size_[axis]);
+    std::vector<kPixelType> projection(Width(axis) * Height(axis));
+    for (size_t i = 0; i < projection.size(); ++i)
+    {
+      double value = 0.0;
+      switch (mode)
+      {
+      case ProjectionMode::kMax:
+        value = double(sums.max[i]) * scale + shift;
+        break;
+      case ProjectionMode::kMin:
+        value = double(sums.min[i]) * scale + shift;
+        break;
+      case ProjectionMode::kSum:
+        value = sums.sum[i] * scale + n * shift;
+        break;
+      case ProjectionMode::kMean:
+        value = sums.sum[i] / n * scale + shift;
+        break;
+      case ProjectionMode::kStd:
+      {
+        const double mean = sums.sum[i] / n;
+        value = std::sqrt(std::max(0.0, sums.squares[i] / n - mean * mean)) * scale;
+        break;
+      }
+      }
+      projection[i] = static_cast<kPixelType>(value);
+    }
+    return projection;
+  }
+
+private:
+  // rows swept through all planes of a batch before moving on
+  static constexpr size_t kRowBlock = 16;
+
+  struct Sums
+  {
+    std::vector<T> max;
+    std::vector<T> min;
+    std::vector<double> sum;
+    std::vector<double> squares;
+  };
+
+  void AddBatch(const T *planes, size_t z_first, size_t count)
+  {
+    const size_t nx = size_[0], ny = size_[1];
+    const unsigned int ranges = ParallelRangeCount(ny, threads_, 1);
+    const size_t rows_per_range = (ny + ranges - 1) / ranges;
+
+    std::vector<Sums> partial_y(ranges);
+    if (axes_[1])
+    {
+      for (Sums &partial : partial_y)
+        Allocate(partial, count * nx);
+    }
+
+    ParallelFor(ranges, ranges, [&](size_t begin, size_t end) {
+      for (size_t r = begin; r < end; ++r)
+      {
+        const size_t y_begin = r * rows_per_range, y_end = std::min(ny, (r + 1) * rows_per_range);
+        for (size_t block = y_begin; block < y_end; block += kRowBlock)
+        {
+          for (size_t p = 0; p < count; ++p)
+          {
+            for (size_t y = block; y < std::min(y_end, block + kRowBlock); ++y)
+              AddRow(planes + (p * ny + y) * nx, z_first + p, y, p, partial_y[r]);
+          }
+        }
+      }
+    }, 1);
+
+    // merge the partial y projections of the batch in range order
+    if (axes_[1])
+    {
+      Sums &y_sums = sums_[1];
+      for (const Sums &partial : partial_y)
+      {
+        const size_t offset = z_first * nx;
+        for (size_t i = 0; i < count * nx; ++i)
+        {
+          if (need_max_)
+            y_sums.max[offset + i] = std::max(y_sums.max[offset + i], partial.max[i]);
+          if (need_min_)
+            y_sums.min[offset + i] = std::min(y_sums.min[offset + i], partial.min[i]);
+          if (need_sum_)
+            y_sums.sum[offset + i] += partial.sum[i];
+          if (need_squares_)
+            y_sums.squares[offset + i] += partial.squares[i];
+        }
+      }
+    }
+  }
+
+  void Allocate(Sums &sums, size_t count) const
+  {
+    if (need_max_)
+      sums.max.assign(count, std::numeric_limits<T>::lowest());
+    if (need_min_)
+      sums.min.assign(count, std::numeric_limits<T>::max());
+    if (need_sum_)
+      sums.sum.assign(count, 0.0);
+    if (need_squares_)
+      sums.squares.assign(count, 0.0);
+  }
+
+  // Reduces row y of plane z (plane p of the batch) into every requested projection
+  void AddRow(const T *row, size_t z, size_t y, size_t p, Sums &partial_y)
+  {
+    const size_t nx = size_[0], ny = size_[1];
+    const size_t x_index = z * ny + y, z_offset = y * nx, y_offset = p * nx;
+
+    if (need_max_)
+    {
+      T x_max = std::numeric_limits<T>::lowest();
+      T *z_max = axes_[2] ? sums_[2].max.data() + z_offset : nullptr;
+      T *y_max = axes_[1] ? partial_y.max.data() + y_offset : nullptr;
+      for (size_t x = 0; x < nx; ++x)
+        x_max = std::max(x_max, row[x]);
+      if (z_max)
+        for (size_t x = 0; x < nx; ++x)
+          z_max[x] = std::max(z_max[x], row[x]);
+      if (y_max)
+        for (size_t x = 0; x < nx; ++x)
+          y_max[x] = std::max(y_max[x], row[x]);
+      if (axes_[0])
+        sums_[0].max[x_index] = x_max;
+    }
+
+    if (need_min_)
+    {
+      T x_min = std::numeric_limits<T>::max();
+      T *z_min = axes_[2] ? sums_[2].min.data() + z_offset : nullptr;
+      T *y_min = axes_[1] ? partial_y.min.data() + y_offset : nullptr;
+      for (size_t x = 0; x < nx; ++x)
+        x_min = std::min(x_min, row[x]);
+      if (z_min)
+        for (size_t x = 0; x < nx; ++x)
+          z_min[x] = std::min(z_min[x], row[x]);
+      if (y_min)
+        for (size_t x = 0; x < nx; ++x)
+          y_min[x] = std::min(y_min[x], row[x]);
+      if (axes_[0])
+        sums_[0].min[x_index] = x_min;
+    }
+
+    if (need_sum_)
+    {
+      double x_sum = 0.0, x_squares = 0.0;
+      double *z_sum = axes_[2] ? sums_[2].sum.data() + z_offset : nullptr;
+      double *y_sum = axes_[1] ? partial_y.sum.data() + y_offset : nullptr;
+      double *z_squares = (axes_[2] && need_squares_) ? sums_[2].squares.data() + z_offset : nullptr;
+      double *y_squares = (axes_[1] && need_squares_) ? partial_y.squares.data() + y_offset : nullptr;
+      for (size_t x = 0; x < nx; ++x)
+        x_sum += double(row[x]);
+      if (need_squares_)
+        for (size_t x = 0; x < nx; ++x)
+          x_squares += double(row[x]) * double(row[x]);
+      if (z_sum)
+        for (size_t x = 0; x < nx; ++x)
+          z_sum[x] += double(row[x]);
+      if (y_sum)
+        for (size_t x = 0; x < nx; ++x)
+          y_sum[x] += double(row[x]);
+      if (z_squares)
+        for (size_t x = 0; x < nx; ++x)
+          z_squares[x] += double(row[x]) * double(row[x]);
+      if (y_squares)
+        for (size_t x = 0; x < nx; ++x)
+          y_squares[x] += double(row[x]) * double(row[x]);
+      if (axes_[0])
+      {
+        sums_[0].sum[x_index] = x_sum;
+        if (need_squares_)
+          sums_[0].squares[x_index] = x_squares;
+      }
+    }
+  }
+
+  std::array<size_t, 3> size_;
+  std::array<bool, 3> axes_;
+  unsigned int threads_;
+  bool need_max_ = false;
+  bool need_min_ = false;
+  bool need_sum_ = false;
+  bool need_squares_ = false;
+  std::array<Sums, 3> sums_;
+};
+
+// Feeds the pages of a TIFF stack to an accumulator in their native type T, which must match
+// the stack's sample type. A reader thread keeps a couple of batches of pages ahead of the
+// projection, so peak memory is a few batches of planes whatever the depth of the stack.
+// Batches match the accumulator's, so every AddPlanes call fills whole plane batches.
+template <class T>
+bool ProjectPages(TiffPageReader &reader, ProjectionAccumulator<T> &accumulator, size_t batch_planes=ProjectionAccumulator<T>::kPlaneBatch)
+{
+  struct Batch
+  {
+    size_t first;
+    size_t planes;
+    std::vector<T> data;
+  };
+
+  const size_t plane_size = reader.Width() * reader.Height(), pages = reader.Pages();
+  if (reader.PageBytes() != plane_size * sizeof(T))
+    return false;
+
+  BoundedQueue<Batch> queue(2);
+  std::atomic<bool> failed(false);
+
+  std::thread read_stage([&]() {
+    for (size_t first = 0; first < pages; first += batch_planes)
+    {
+      Batch batch;
+      batch.first = first;
+      batch.planes = std::min(batch_planes, pages - first);
+      batch.data.resize(batch.planes * plane_size);
+      for (size_t p = 0; p < batch.planes && !failed; ++p)
+        failed = !reader.ReadRawPage(first + p, batch.data.data() + p * plane_size);
+      if (failed || !queue.Push(std::move(batch)))
+        break;
+    }
+    queue.Close();
+  });
+
+  Batch batch;
+  while (queue.Pop(batch))
+    accumulator.AddPlanes(batch.data.data(), batch.first, batch.planes);
+  read_stage.join();
+
+  return !failed;
+}
+
+// Every requested projection of one image in the working precision, as returned by
+// ProjectionAccumulator::Projection, indexed by axis and by position in the list of modes
+struct ImageProjections
+{
+  std::array<size_t, 3> width = {{0, 0, 0}};
+  std::array<size_t, 3> height = {{0, 0, 0}};
+  std::array<std::vector<std::vector<kPixelType>>, 3> projections;
+};
+
+template <class T>
+void CollectProjections(const ProjectionAccumulator<T> &accumulator, const std::array<bool, 3> &axes, const std::vector<ProjectionMode> &modes, ImageProjections &out)
+{
+  for (unsigned int axis = 0; axis < 3; ++axis)
+  {
+    out.projections[axis].clear();
+    if (!axes[axis])
+      continue;
+
+    out.width[axis] = accumulator.Width(axis);
+    out.height[axis] = accumulator.Height(axis);
+    for (ProjectionMode mode : modes)
+      out.projections[axis].push_back(accumulator.Projection(axis, mode));
+  }
+}
+
+// Projects the image at path in one pass. Single channel, stripped TIFF stacks are streamed
+// page by page in their own pixel type; other images are read whole.
+bool ProjectImageFile(const std::string &path, const std::array<bool, 3> &axes, const std::vector<ProjectionMode> &modes, unsigned int threads, ImageProjections &out, bool verbose=false)
+{
+  TiffPageReader reader;
+  if (reader.Open(path))
+  {
+    const bool is_float = (reader.SampleFormat() == SAMPLEFORMAT_IEEEFP);
+    const bool is_signed = (reader.SampleFormat() == SAMPLEFORMAT_INT);
+
+    auto project_stream = [&](auto pixel) -> bool {
+      using PixelType = decltype(pixel);
+      ProjectionAccumulator<PixelType> accumulator(reader.Width(), reader.Height(), reader.Pages(), axes, modes, threads);
+      if (!ProjectPages(reader, accumulator))
+        return false;
+      CollectProjections(accumulator, axes, modes, out);
+      return true;
+    };
+
+    if (verbose)
+      std::cout << "Streaming " << reader.Pages() << " pages of " << reader.BitsPerSample() << "-bit samples from " << path << std::endl;
+
+    switch (reader.BitsPerSample())
+    {
+    case 8:
+      return is_signed ? project_stream(char()) : project_stream((unsigned char)0);
+    case 16:
+      return is_signed ? project_stream(short()) : project_stream((unsigned short)0);
+    case 32:
+      if (is_float)
+        return project_stream(float());
+      return is_signed ? project_stream(int()) : project_stream((unsigned int)0);
+    case 64:
+      if (is_float)
+        return project_stream(double());
+    }
+    reader.Close();
+  }
+
+  kImageType::Pointer img = ReadImageFile<kImageType>(path);
+  if (img == nullptr)
+    return false;
+
+  kImageType::SizeType img_size = img->GetLargestPossibleRegion().GetSize();
+  ProjectionAccumulator<kPixelType> accumulator(img_size[0], img_size[1], img_size[2], axes, modes, threads);
+  accumulator.AddPlanes(img->GetBufferPointer(), 0, img_size[2]);
+  CollectProjections(accumulator, axes, modes, out);
+  return true;
+}
+
+// Samples a width x height image along the line from (line[0], line[1]) to (line[2], line[3])
+// at unit steps with bilinear interpolation, clamping to the edge pixels
+std::vector<kPixelType> SampleLine(const std::vector<kPixelType> &image, size_t width, size_t height, const std::array<float, 4> &line)
+{
+  const double dx = line[2] - line[0], dy = line[3] - line[1];
+  const size_t samples = static_cast<size_t>(std::floor(std::sqrt(dx * dx + dy * dy))) + 1;
+  const double step = (samples > 1) ? 1.0 / (samples - 1) : 0.0;
+
+  std::vector<kPixelType> profile(samples);
+  for (size_t i = 0; i < samples; ++i)
+  {
+    const double x = std::min(std::max(line[0] + dx * i * step, 0.0), double(width - 1));
+    const double y = std::min(std::max(line[1] + dy * i * step, 0.0), double(height - 1));
+    const size_t x0 = static_cast<size_t>(x), y0 = static_cast<size_t>(y);
+    const size_t x1 = std::min(x0 + 1, width - 1), y1 = std::min(y0 + 1, height - 1);
+    const double fx = x - x0, fy = y - y0;
+
+    const double top = image[y0 * width + x0] * (1.0 - fx) + image[y0 * width + x1] * fx;
+    const double bottom = image[y1 * width + x0] * (1.0 - fx) + image[y1 * width + x1] * fx;
+    profile[i] = static_cast<kPixelType>(top * (1.0 - fy) + bottom * fy);
+  }
+  return profile;
+}
+
+// Writes 2D frames of width x height pixels in the working precision as the time points of
+// one multipage TIFF of TPixel
+template <class TPixel>
+bool WriteProjectionSeries(const std::string &path, const std::vector<std::vector<kPixelType>> &frames, size_t width, size_t height, uint16_t compression=COMPRESSION_NONE)
+{
+  TiffPageWriter<TPixel> writer;
+  if (!writer.Open(path, width, height, frames.size(), {{1.0, 1.0, 1.0}}, true, "", compression))
+    return false;
+
+  for (const std::vector<kPixelType> &frame : frames)
+  {
+    if (!writer.WritePage(frame.data()))
+      return false;
+  }
+  return writer.Close();
+}
@@ -0,0 +1,81 @@
+#include "defines.h"
+#include "reader.h"
+#include "writer.h"
+#include "resampler.h"
+#include "padding.h"
+#include "otf.h"
+#include "rl.h"
+#include "tiling.h"
+
+#include <cmath>
+
+// Deconvolves the example stack whole and in overlapping tiles and compares the results
+int main()
+{
+#ifdef LLSM_HAVE_FFTW
+    std::string image_path("examples/cell2_ch1_CAM1_stack0001_488nm_0004529msec_0009990533msecAbs_000x_000y_000z_0000t.tif");
+    std::string psf_path("examples/488_PSF_piezoScan.tif");
+    RichardsonLucySettings settings;
+    settings.iterations = 10;
+    unsigned int workers = 2;
+
+    kImageType::Pointer image = ReadImageFile<kImageType>(image_path, true);
+    kImageType::Pointer psf = ReadImageFile<kImageType>(psf_path, true);
+    if (image == nullptr || psf == nullptr)
+    {
+        std::cerr << "Unable to read " << image_path.c_str() << " or " << psf_path.c_str() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    kImageType::SpacingType spacing;
+    spacing[0] = 0.104;
+    spacing[1] = 0.104;
+    spacing[2] = 0.4;
+    image->SetSpacing(spacing);
+    spacing[2] = 0.1;
+    psf->SetSpacing(spacing);
+    psf = Resampler(psf, image->GetSpacing(), true);
+
+    kImageType::SizeType img_size = image->GetLargestPossibleRegion().GetSize();
+    kImageType::SizeType psf_size = psf->GetLargestPossibleRegion().GetSize();
+    std::array<size_t, kDimensions> image_dims = {img_size[0], img_size[1], img_size[2]};
+    std::array<size_t, kDimensions> kernel_dims = {psf_size[0], psf_size[1], psf_size[2]};
+
+    // whole volume
+    PadGeometry geometry = ComputePadGeometry(image_dims, kernel_dims);
+    std::unique_ptr<OTF> otf = OTF::Compute(psf->GetBufferPointer(), geometry);
+    RichardsonLucyDeconvolver deconvolver(geometry, 4, FFTW_ESTIMATE);
+    kImageType::Pointer whole = RichardsonLucyOTF(image, *otf, deconvolver, settings);
+
+    // tiles limited to half the memory of the whole volume
+    size_t max_bytes = TiledMemory(MakeTileLayout(image_dims, kernel_dims, {1, 1, 1}), kernel_dims, workers) / 2;
+    TileLayout layout = ComputeTileLayout(image_dims, kernel_dims, max_bytes, workers);
+    printf("Tiles: %zux%zux%zu of %zux%zux%zu\n", layout.count[0], layout.count[1], layout.count[2], layout.extent[0], layout.extent[1], layout.extent[2]);
+
+    PadGeometry tile_geometry = ComputePadGeometry(layout.extent, kernel_dims);
+    std::unique_ptr<OTF> tile_otf = OTF::Compute(psf->GetBufferPointer(), tile_geometry);
+    TiledDeconvolver tiled_deconvolver(layout, tile_geometry, workers, 4, FFTW_ESTIMATE);
+    kImageType::Pointer tiled = RichardsonLucyTiled(image, *tile_otf, tiled_deconvolver, settings, true);
+
+    WriteImageFile<kImageType, itk::Image<float, kDimensions>>(tiled, "tiled-decon-test.tif", true);
+
+    // compare
+    const kPixelType *a = whole->GetBufferPointer();
+    const kPixelType *b = tiled->GetBufferPointer();
+    double max_error = 0.0, sum_error = 0.0, sum_value = 0.0;
+    for (size_t i = 0; i < geometry.image[0] * geometry.image[1] * geometry.image[2]; ++i)
+    {
+        double error = std::abs(double(a[i]) - double(b[i]));
+        max_error = std::max(max_error, error);
+        sum_error += error * error;
+        sum_value += double(a[i]) * double(a[i]);
+    }
+    double relative_rms = std::sqrt(sum_error / sum_value);
+    printf("Max error: %g, relative RMS error: %g\n", max_error, relative_rms);
+
+    return (relative_rms < 0.01) ? EXIT_SUCCESS : EXIT_FAILURE;
+#else
+    std::cerr << "Tiled deconvolution requires ITK built with FFTW in the working precision" << std::endl;
+    return EXIT_FAILURE;
+#endif
+}
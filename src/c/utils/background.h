@@ -0,0 +1,261 @@
+#pragma once
+
+#include "defines.h"
+#include "utils.h"
+#include "reader.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include <itkImage.h>
+#include <itkImageFileReader.h>
+#include <itkImageIOBase.h>
+#include <itkMultiThreaderBase.h>
+
+enum class BackgroundMode
+{
+    kNone,
+    kConstant,  // the same value for every pixel
+    kImage,     // a camera offset image, one value per pixel of a slice
+    kPercentile // a percentile of the intensities of each slice
+};
+
+// Camera background removed from raw intensities while they are converted to the working
+// precision. Values are in raw intensity units of the input file.
+struct Background
+{
+    BackgroundMode mode = BackgroundMode::kNone;
+    double constant = 0.0;
+    double percentile = 0.0; // 0 to 100
+    std::vector<float> offset; // x-fastest, offset_width by offset_height
+    size_t offset_width = 0;
+    size_t offset_height = 0;
+};
+
+// Reads a 2D camera offset image without rescaling its intensities
+bool ReadBackgroundImage(const std::string &path, Background &background)
+{
+    itk::ImageIOBase::Pointer image_io = itk::ImageIOFactory::CreateImageIO(path.c_str(), itk::CommonEnums::IOFileMode::ReadMode);
+    if (image_io == nullptr)
+        return false;
+
+    image_io->SetFileName(path.c_str());
+    image_io->ReadImageInformation();
+
+    using OffsetImageType = itk::Image<float, 2>;
+    OffsetImageType::Pointer offset = ReadImage<2, OffsetImageType>(path.c_str(), image_io->GetComponentType(), false);
+    if (offset == nullptr)
+        return false;
+
+    OffsetImageType::SizeType size = offset->GetLargestPossibleRegion().GetSize();
+    background.mode = BackgroundMode::kImage;
+    background.offset_width = size[0];
+    background.offset_height = size[1];
+    background.offset.assign(offset->GetBufferPointer(), offset->GetBufferPointer() + size[0] * size[1]);
+
+    return true;
+}
+
+// Converts one slice of raw intensities to the output range like ConvertImage with scaling,
+// subtracting the background and clamping in the same pass
+template <class TIn, class TOut>
+void ConvertSliceSubtracted(const TIn *slice, TOut *result, size_t plane_size, const Background &background)
+{
+    double input_min, input_max, output_min, output_max;
+    GetRange<TIn>(input_min, input_max);
+    GetRange<TOut>(output_min, output_max);
+    const double scale = (output_max - output_min) / (input_max - input_min);
+
+    // floating point input is only clamped when a background is subtracted, as ConvertImage
+    // passes it through unchanged
+    const bool clamp = !std::is_floating_point<TIn>::value || background.mode != BackgroundMode::kNone;
+
+    double constant = (background.mode == BackgroundMode::kConstant) ? background.constant : 0.0;
+    if (background.mode == BackgroundMode::kPercentile)
+    {
+        std::vector<TIn> sorted(slice, slice + plane_size);
+        size_t rank = static_cast<size_t>(background.percentile / 100.0 * (sorted.size() - 1) + 0.5);
+        std::nth_element(sorted.begin(), sorted.begin() + rank, sorted.end());
+        constant = sorted[rank];
+    }
+
+    // intensity below the background is clamped to the bottom of the output range
+    const double offset = constant + input_min;
+    for (size_t i = 0; i < plane_size; ++i)
+    {
+        double value = double(slice[i]) - offset;
+        if (background.mode == BackgroundMode::kImage)
+            value -= background.offset[i];
+        value = output_min + value * scale;
+        result[i] = static_cast<TOut>(clamp ? std::min(std::max(value, output_min), output_max) : value);
+    }
+}
+
+// Checks that a camera offset image covers slices of sx by sy pixels
+bool BackgroundMatches(const Background &background, size_t sx, size_t sy)
+{
+    if (background.mode == BackgroundMode::kImage && (background.offset_width != sx || background.offset_height != sy))
+    {
+        std::cerr << "Background image is " << background.offset_width << "x" << background.offset_height
+                  << " but image slices are " << sx << "x" << sy << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Converts raw intensities to the output range like ConvertImage with scaling, subtracting the
+// background and clamping in the same pass so no intermediate volumes are allocated
+template <class TImageIn, class TImageOut>
+typename TImageOut::Pointer ConvertImageSubtracted(typename TImageIn::Pointer image_in, const Background &background)
+{
+    typename TImageIn::SizeType size = image_in->GetLargestPossibleRegion().GetSize();
+    const size_t sx = size[0], sy = size[1], sz = size[2];
+    if (!BackgroundMatches(background, sx, sy))
+        return nullptr;
+
+    typename TImageOut::Pointer image_out = TImageOut::New();
+    image_out->SetRegions(image_in->GetLargestPossibleRegion());
+    image_out->SetSpacing(image_in->GetSpacing());
+    image_out->SetOrigin(image_in->GetOrigin());
+    image_out->SetDirection(image_in->GetDirection());
+    image_out->Allocate();
+
+    const typename TImageIn::PixelType *in = image_in->GetBufferPointer();
+    typename TImageOut::PixelType *out = image_out->GetBufferPointer();
+    const unsigned int threads = itk::MultiThreaderBase::GetGlobalDefaultNumberOfThreads();
+
+    ParallelFor(sz, threads, [&](size_t begin, size_t end) {
+        for (size_t z = begin; z < end; ++z)
+            ConvertSliceSubtracted(in + z * sx * sy, out + z * sx * sy, sx * sy, background);
+    }, 1);
+
+    return image_out;
+}
+
+// Reads a TIFF stack through a memory mapping like ReadMappedTiff, decoding its pages in
+// parallel and subtracting the background from each as it is converted, so no volume in the
+// file's own type is held. Returns nullptr if the file cannot be mapped, so the caller can
+// fall back to ITK.
+template <class TImage>
+itk::SmartPointer<TImage> ReadMappedTiffSubtracted(const std::string &file_path, const Background &background, bool verbose=false)
+{
+    MappedTiff tiff;
+    if (!tiff.Open(file_path))
+        return nullptr;
+
+    typename TImage::SizeType size;
+    size[0] = tiff.Width();
+    size[1] = tiff.Height();
+    size[2] = tiff.Pages();
+    typename TImage::RegionType region;
+    region.SetSize(size);
+
+    typename TImage::SpacingType spacing;
+    spacing[0] = tiff.XSpacing();
+    spacing[1] = tiff.YSpacing();
+    spacing[2] = 1.0;
+
+    itk::SmartPointer<TImage> image = TImage::New();
+    image->SetRegions(region);
+    image->SetSpacing(spacing);
+    image->Allocate();
+
+    if (verbose)
+        std::cout << "Mapped " << tiff.Pages() << (tiff.Compressed() ? " compressed" : "") << " pages of " << tiff.BitsPerSample() << "-bit samples from " << file_path << std::endl;
+
+    const size_t plane_size = size[0] * size[1];
+    typename TImage::PixelType *buffer = image->GetBufferPointer();
+    std::atomic<bool> failed(false);
+    ParallelFor(size[2], itk::MultiThreaderBase::GetGlobalDefaultNumberOfThreads(), [&](size_t begin, size_t end) {
+        const bool visited = tiff.VisitPages(begin, end, [&](size_t page, const auto *pixels) {
+            ConvertSliceSubtracted(pixels, buffer + page * plane_size, plane_size, background);
+        });
+        if (!visited)
+            failed = true;
+    }, 1);
+
+    if (failed)
+        return nullptr;
+    return image;
+}
+
+template <class TImageIn, class TImageOut>
+typename TImageOut::Pointer ReadAndSubtractImage(const char *file_path, const Background &background)
+{
+    using ImageReaderType = itk::ImageFileReader<TImageIn>;
+
+    typename ImageReaderType::Pointer reader = ImageReaderType::New();
+    reader->SetFileName(file_path);
+
+    try
+    {
+        reader->Update();
+    }
+    catch (itk::ExceptionObject &e)
+    {
+        std::cerr << e.what() << std::endl;
+        return nullptr;
+    }
+
+    return ConvertImageSubtracted<TImageIn, TImageOut>(reader->GetOutput(), background);
+}
+
+// Reads a 3D image of any integer or floating point type into the working precision, scaled to
+// [0, 1] like ReadImageFile, with the background subtracted during the conversion
+template <class TImage>
+itk::SmartPointer<TImage> ReadImageFileSubtracted(std::string file_path, const Background &background, bool verbose=false)
+{
+    itk::ImageIOBase::Pointer image_io = itk::ImageIOFactory::CreateImageIO(file_path.c_str(), itk::CommonEnums::IOFileMode::ReadMode);
+    if (image_io == nullptr)
+        return nullptr;
+
+    image_io->SetFileName(file_path.c_str());
+    image_io->ReadImageInformation();
+    if (image_io->GetNumberOfDimensions() > 1 && !BackgroundMatches(background, image_io->GetDimensions(0), image_io->GetDimensions(1)))
+        return nullptr;
+
+    // TIFF stacks are mapped and decoded in parallel, anything else is read by ITK
+    itk::SmartPointer<TImage> mapped = ReadMappedTiffSubtracted<TImage>(file_path, background, verbose);
+    if (mapped != nullptr)
+        return mapped;
+
+    const itk::IOComponentEnum component_type = image_io->GetComponentType();
+    if (verbose)
+        std::cout << "Component Type is " << image_io->GetComponentTypeAsString(component_type) << std::endl;
+
+    if (image_io->GetPixelType() != itk::IOPixelEnum::SCALAR)
+    {
+        std::cerr << "not implemented yet!" << std::endl;
+        return nullptr;
+    }
+
+    switch (component_type)
+    {
+    case itk::IOComponentEnum::UCHAR:
+        return ReadAndSubtractImage<itk::Image<unsigned char, kDimensions>, TImage>(file_path.c_str(), background);
+    case itk::IOComponentEnum::CHAR:
+        return ReadAndSubtractImage<itk::Image<char, kDimensions>, TImage>(file_path.c_str(), background);
+    case itk::IOComponentEnum::USHORT:
+        return ReadAndSubtractImage<itk::Image<unsigned short, kDimensions>, TImage>(file_path.c_str(), background);
+    case itk::IOComponentEnum::SHORT:
+        return ReadAndSubtractImage<itk::Image<short, kDimensions>, TImage>(file_path.c_str(), background);
+    case itk::IOComponentEnum::UINT:
+        return ReadAndSubtractImage<itk::Image<unsigned int, kDimensions>, TImage>(file_path.c_str(), background);
+    case itk::IOComponentEnum::INT:
+        return ReadAndSubtractImage<itk::Image<int, kDimensions>, TImage>(file_path.c_str(), background);
+    case itk::IOComponentEnum::ULONG:
+        return ReadAndSubtractImage<itk::Image<unsigned long int, kDimensions>, TImage>(file_path.c_str(), background);
+    case itk::IOComponentEnum::LONG:
+        return ReadAndSubtractImage<itk::Image<long int, kDimensions>, TImage>(file_path.c_str(), background);
+    case itk::IOComponentEnum::FLOAT:
+        return ReadAndSubtractImage<itk::Image<float, kDimensions>, TImage>(file_path.c_str(), background);
+    case itk::IOComponentEnum::DOUBLE:
+        return ReadAndSubtractImage<itk::Image<double, kDimensions>, TImage>(file_path.c_str(), background);
+    default:
+        std::cerr << "Unknown and unsupported component type!" << std::endl;
+        return nullptr;
+    }
+}
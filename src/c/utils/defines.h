@@ -12,6 +12,14 @@
 
 // Globals
 constexpr unsigned int kDimensions = 3;
+
+// Working precision for all tools. Single precision halves memory and bandwidth
+// and lets FFTW use its float plans; build with -DLLSM_DOUBLE_PRECISION=ON to
+// restore double precision processing.
+#ifdef LLSM_DOUBLE_PRECISION
 using kPixelType = double;
+#else
+using kPixelType = float;
+#endif
 using kImageType = itk::Image<kPixelType, kDimensions>;
 using kSliceType = itk::Image<kPixelType, 2>;
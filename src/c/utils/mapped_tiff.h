@@ -0,0 +1,487 @@
+#pragma once
+
+#include "stream.h"
+
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Read-only memory mapping of a single channel TIFF or BigTIFF stack. The IFD chain is parsed
+// once on Open. Uncompressed pages are read straight from the mapping, so loading a stack costs
+// one pass over the page cache and no copy of the file in native type. Compressed pages are
+// decoded by libtiff, which is pointed directly at each page's IFD, so any range of pages can
+// be decoded independently of the others. Tiled, multi-sample or big-endian files are
+// rejected, so callers can fall back to a general reader.
+class MappedTiff
+{
+public:
+    MappedTiff() = default;
+    MappedTiff(const MappedTiff &) = delete;
+    MappedTiff &operator=(const MappedTiff &) = delete;
+
+    ~MappedTiff() { Close(); }
+
+    bool Open(const std::string &path)
+    {
+        Close();
+
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size < 16)
+        {
+            close(fd);
+            return false;
+        }
+
+        path_ = path;
+        size_ = static_cast<size_t>(st.st_size);
+        void *mapping = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mapping == MAP_FAILED)
+            return false;
+        data_ = static_cast<const unsigned char *>(mapping);
+
+        if (!ParseIFDs())
+        {
+            Close();
+            return false;
+        }
+        return true;
+    }
+
+    void Close()
+    {
+        if (data_ != nullptr)
+            munmap(const_cast<unsigned char *>(data_), size_);
+        data_ = nullptr;
+        size_ = 0;
+        pages_.clear();
+    }
+
+    size_t Width() const { return width_; }
+    size_t Height() const { return height_; }
+    size_t Pages() const { return pages_.size(); }
+    uint16_t BitsPerSample() const { return bits_; }
+    uint16_t SampleFormat() const { return format_; }
+    bool Compressed() const { return compression_ != COMPRESSION_NONE; }
+    size_t PageBytes() const { return width_ * height_ * (bits_ / 8); }
+
+    // Pixel size the way ITK's TIFFImageIO reports it: from the resolution tags in mm when
+    // the unit is inches or centimeters, and 1 otherwise
+    double XSpacing() const { return x_spacing_; }
+    double YSpacing() const { return y_spacing_; }
+
+    // Pixels of a page in the file's own type, or nullptr if its strips are compressed or
+    // not contiguous
+    const void *PageData(size_t page) const
+    {
+        if (Compressed())
+            return nullptr;
+        const Page &p = pages_[page];
+        for (size_t s = 1; s < p.offsets.size(); ++s)
+        {
+            if (p.offsets[s] != p.offsets[s - 1] + p.counts[s - 1])
+                return nullptr;
+        }
+        return data_ + p.offsets[0];
+    }
+
+    // Converts one uncompressed page into out like ReadImageFile, scaled or cast
+    template <class TOut>
+    bool ConvertPage(size_t page, TOut *out, bool scale = true) const
+    {
+        if (Compressed())
+            return false;
+        return DispatchType([&](auto pixel) {
+            return this->template ConvertStrips<decltype(pixel)>(page, out, scale);
+        });
+    }
+
+    // Converts pages [begin, end) into consecutive planes of out like ReadImageFile. Compressed
+    // pages are decoded with a libtiff handle of the call's own, so calls on disjoint ranges
+    // can run concurrently.
+    template <class TOut>
+    bool ConvertPages(size_t begin, size_t end, TOut *out, bool scale = true) const
+    {
+        const size_t plane_size = width_ * height_;
+        if (!Compressed())
+        {
+            for (size_t page = begin; page < end; ++page)
+            {
+                if (!ConvertPage(page, out + (page - begin) * plane_size, scale))
+                    return false;
+            }
+            return true;
+        }
+
+        TIFF *tiff = TIFFOpen(path_.c_str(), "r");
+        if (tiff == nullptr)
+            return false;
+
+        std::vector<unsigned char> raw(PageBytes());
+        bool decoded = true;
+        for (size_t page = begin; page < end && decoded; ++page)
+        {
+            decoded = TIFFSetSubDirectory(tiff, pages_[page].ifd) && DecodeStrips(tiff, raw);
+            if (decoded)
+            {
+                TOut *plane = out + (page - begin) * plane_size;
+                decoded = DispatchType([&](auto pixel) {
+                    ConvertRange(reinterpret_cast<const decltype(pixel) *>(raw.data()), plane, plane_size, scale);
+                    return true;
+                });
+            }
+        }
+
+        TIFFClose(tiff);
+        return decoded;
+    }
+
+    // Calls f(page, pixels) for pages [begin, end), with pixels pointing at the page's samples
+    // in the file's own type, x fastest. Pages that lie contiguous and aligned in the mapping
+    // are passed in place, others are decoded or copied into a buffer of the call's own, so
+    // calls on disjoint ranges can run concurrently.
+    template <class F>
+    bool VisitPages(size_t begin, size_t end, F f) const
+    {
+        TIFF *tiff = nullptr;
+        if (Compressed())
+        {
+            tiff = TIFFOpen(path_.c_str(), "r");
+            if (tiff == nullptr)
+                return false;
+        }
+
+        std::vector<unsigned char> raw;
+        bool visited = true;
+        for (size_t page = begin; page < end && visited; ++page)
+        {
+            const unsigned char *pixels = Compressed() ? nullptr : static_cast<const unsigned char *>(PageData(page));
+            if (pixels == nullptr || reinterpret_cast<uintptr_t>(pixels) % (bits_ / 8) != 0)
+            {
+                raw.resize(PageBytes());
+                if (Compressed())
+                    visited = TIFFSetSubDirectory(tiff, pages_[page].ifd) && DecodeStrips(tiff, raw);
+                else
+                    visited = CopyStrips(page, raw);
+                pixels = raw.data();
+            }
+            if (visited)
+            {
+                visited = DispatchType([&](auto pixel) {
+                    f(page, reinterpret_cast<const decltype(pixel) *>(pixels));
+                    return true;
+                });
+            }
+        }
+
+        if (tiff != nullptr)
+            TIFFClose(tiff);
+        return visited;
+    }
+
+private:
+    struct Page
+    {
+        uint64_t ifd;
+        std::vector<uint64_t> offsets;
+        std::vector<uint64_t> counts;
+    };
+
+    // Calls f with a value of the file's sample type, returning what f returns
+    template <class F>
+    bool DispatchType(F f) const
+    {
+        const bool is_float = (format_ == SAMPLEFORMAT_IEEEFP);
+        const bool is_signed = (format_ == SAMPLEFORMAT_INT);
+        switch (bits_)
+        {
+        case 8:
+            return is_signed ? f(char()) : f((unsigned char)0);
+        case 16:
+            return is_signed ? f(short()) : f((unsigned short)0);
+        case 32:
+            if (is_float)
+                return f(float());
+            return is_signed ? f(int()) : f((unsigned int)0);
+        case 64:
+            if (is_float)
+                return f(double());
+        }
+        return false;
+    }
+
+    // Decodes the strips of the current directory into a page of raw samples
+    bool DecodeStrips(TIFF *tiff, std::vector<unsigned char> &raw) const
+    {
+        size_t offset = 0;
+        for (uint32_t strip = 0; strip < TIFFNumberOfStrips(tiff) && offset < raw.size(); ++strip)
+        {
+            tmsize_t bytes = TIFFReadEncodedStrip(tiff, strip, raw.data() + offset, raw.size() - offset);
+            if (bytes < 0)
+                return false;
+            offset += bytes;
+        }
+        return offset == raw.size();
+    }
+
+    // Copies the strips of an uncompressed page into a page of raw samples
+    bool CopyStrips(size_t page, std::vector<unsigned char> &raw) const
+    {
+        const Page &p = pages_[page];
+        size_t offset = 0;
+        for (size_t s = 0; s < p.offsets.size() && offset < raw.size(); ++s)
+        {
+            const size_t bytes = std::min<size_t>(p.counts[s], raw.size() - offset);
+            std::memcpy(raw.data() + offset, data_ + p.offsets[s], bytes);
+            offset += bytes;
+        }
+        return offset == raw.size();
+    }
+
+    // Strips are converted where they lie in the mapping, or through a small copy when they
+    // are not aligned for TIn
+    template <class TIn, class TOut>
+    bool ConvertStrips(size_t page, TOut *out, bool scale) const
+    {
+        const Page &p = pages_[page];
+        size_t remaining = width_ * height_;
+        std::vector<TIn> unaligned;
+        for (size_t s = 0; s < p.offsets.size() && remaining > 0; ++s)
+        {
+            const size_t count = std::min<size_t>(remaining, p.counts[s] / sizeof(TIn));
+            const unsigned char *strip = data_ + p.offsets[s];
+            if (reinterpret_cast<uintptr_t>(strip) % alignof(TIn) == 0)
+            {
+                ConvertRange(reinterpret_cast<const TIn *>(strip), out, count, scale);
+            }
+            else
+            {
+                unaligned.resize(count);
+                std::memcpy(unaligned.data(), strip, count * sizeof(TIn));
+                ConvertRange(unaligned.data(), out, count, scale);
+            }
+            out += count;
+            remaining -= count;
+        }
+        return remaining == 0;
+    }
+
+    template <class T>
+    T Get(uint64_t offset) const
+    {
+        T value;
+        std::memcpy(&value, data_ + offset, sizeof(T));
+        return value;
+    }
+
+    bool InBounds(uint64_t offset, uint64_t bytes) const
+    {
+        return offset <= size_ && bytes <= size_ - offset;
+    }
+
+    // Reads the integer values of an IFD entry of type BYTE, SHORT, LONG or LONG8
+    bool EntryValues(uint64_t entry, std::vector<uint64_t> &values) const
+    {
+        const uint16_t type = Get<uint16_t>(entry + 2);
+        const uint64_t count = big_ ? Get<uint64_t>(entry + 4) : Get<uint32_t>(entry + 4);
+        const uint64_t value_field = entry + (big_ ? 12 : 8);
+        const uint64_t inline_bytes = big_ ? 8 : 4;
+
+        uint64_t type_bytes = 0;
+        switch (type)
+        {
+        case 1: type_bytes = 1; break;  // BYTE
+        case 3: type_bytes = 2; break;  // SHORT
+        case 4: type_bytes = 4; break;  // LONG
+        case 16: type_bytes = 8; break; // LONG8
+        default: return false;
+        }
+        if (count == 0 || count > size_ / type_bytes)
+            return false;
+
+        uint64_t offset = value_field;
+        if (count * type_bytes > inline_bytes)
+            offset = big_ ? Get<uint64_t>(value_field) : Get<uint32_t>(value_field);
+        if (!InBounds(offset, count * type_bytes))
+            return false;
+
+        values.resize(count);
+        for (uint64_t i = 0; i < count; ++i)
+        {
+            const uint64_t at = offset + i * type_bytes;
+            switch (type_bytes)
+            {
+            case 1: values[i] = data_[at]; break;
+            case 2: values[i] = Get<uint16_t>(at); break;
+            case 4: values[i] = Get<uint32_t>(at); break;
+            default: values[i] = Get<uint64_t>(at); break;
+            }
+        }
+        return true;
+    }
+
+    // Reads the value of a RATIONAL IFD entry
+    bool EntryRational(uint64_t entry, double &value) const
+    {
+        if (Get<uint16_t>(entry + 2) != 5)
+            return false;
+        const uint64_t value_field = entry + (big_ ? 12 : 8);
+        const uint64_t offset = big_ ? value_field : Get<uint32_t>(value_field);
+        if (!InBounds(offset, 8))
+            return false;
+        const uint32_t denominator = Get<uint32_t>(offset + 4);
+        value = (denominator != 0) ? double(Get<uint32_t>(offset)) / denominator : 0.0;
+        return true;
+    }
+
+    bool ParseIFDs()
+    {
+        if (data_[0] != 'I' || data_[1] != 'I')
+            return false;
+
+        const uint16_t version = Get<uint16_t>(2);
+        if (version == 42)
+            big_ = false;
+        else if (version == 43 && Get<uint16_t>(4) == 8)
+            big_ = true;
+        else
+            return false;
+
+        const uint64_t count_bytes = big_ ? 8 : 2, entry_bytes = big_ ? 20 : 12, next_bytes = big_ ? 8 : 4;
+        uint64_t ifd = big_ ? Get<uint64_t>(8) : Get<uint32_t>(4);
+
+        while (ifd != 0)
+        {
+            // IFDs must move forward through the file, which also rules out loops
+            if (!InBounds(ifd, count_bytes) || (!pages_.empty() && ifd <= last_ifd_))
+                return false;
+            last_ifd_ = ifd;
+
+            const uint64_t entries = big_ ? Get<uint64_t>(ifd) : Get<uint16_t>(ifd);
+            if (entries > size_ / entry_bytes || !InBounds(ifd + count_bytes, entries * entry_bytes + next_bytes))
+                return false;
+
+            uint64_t width = 0, height = 0, bits = 1, format = SAMPLEFORMAT_UINT, samples = 1, compression = 1, planar = 1;
+            uint64_t unit = 2;
+            double x_resolution = 0.0, y_resolution = 0.0;
+            Page page;
+            page.ifd = ifd;
+            std::vector<uint64_t> values;
+            for (uint64_t e = 0; e < entries; ++e)
+            {
+                const uint64_t entry = ifd + count_bytes + e * entry_bytes;
+                const uint16_t tag = Get<uint16_t>(entry);
+                switch (tag)
+                {
+                case TIFFTAG_TILEWIDTH:
+                case TIFFTAG_TILEOFFSETS:
+                    return false;
+                case TIFFTAG_XRESOLUTION:
+                    EntryRational(entry, x_resolution);
+                    continue;
+                case TIFFTAG_YRESOLUTION:
+                    EntryRational(entry, y_resolution);
+                    continue;
+                case TIFFTAG_IMAGEWIDTH:
+                case TIFFTAG_IMAGELENGTH:
+                case TIFFTAG_BITSPERSAMPLE:
+                case TIFFTAG_COMPRESSION:
+                case TIFFTAG_SAMPLESPERPIXEL:
+                case TIFFTAG_PLANARCONFIG:
+                case TIFFTAG_RESOLUTIONUNIT:
+                case TIFFTAG_SAMPLEFORMAT:
+                case TIFFTAG_STRIPOFFSETS:
+                case TIFFTAG_STRIPBYTECOUNTS:
+                    break;
+                default:
+                    continue;
+                }
+
+                if (!EntryValues(entry, values))
+                    return false;
+                switch (tag)
+                {
+                case TIFFTAG_IMAGEWIDTH: width = values[0]; break;
+                case TIFFTAG_IMAGELENGTH: height = values[0]; break;
+                case TIFFTAG_BITSPERSAMPLE: bits = values[0]; break;
+                case TIFFTAG_COMPRESSION: compression = values[0]; break;
+                case TIFFTAG_SAMPLESPERPIXEL: samples = values[0]; break;
+                case TIFFTAG_PLANARCONFIG: planar = values[0]; break;
+                case TIFFTAG_RESOLUTIONUNIT: unit = values[0]; break;
+                case TIFFTAG_SAMPLEFORMAT: format = values[0]; break;
+                case TIFFTAG_STRIPOFFSETS: page.offsets = values; break;
+                case TIFFTAG_STRIPBYTECOUNTS: page.counts = values; break;
+                }
+            }
+
+            if (samples != 1 || planar != PLANARCONFIG_CONTIG || width == 0 || height == 0)
+                return false;
+            if (bits != 8 && bits != 16 && bits != 32 && bits != 64)
+                return false;
+            if (page.offsets.empty() || page.offsets.size() != page.counts.size())
+                return false;
+
+            // every page must match the first one
+            if (pages_.empty())
+            {
+                width_ = width;
+                height_ = height;
+                bits_ = static_cast<uint16_t>(bits);
+                format_ = static_cast<uint16_t>(format);
+                compression_ = static_cast<uint16_t>(compression);
+                x_spacing_ = y_spacing_ = 1.0;
+                if (x_resolution > 0.0 && y_resolution > 0.0 && (unit == RESUNIT_INCH || unit == RESUNIT_CENTIMETER))
+                {
+                    const double mm_per_unit = (unit == RESUNIT_INCH) ? 25.4 : 10.0;
+                    x_spacing_ = mm_per_unit / x_resolution;
+                    y_spacing_ = mm_per_unit / y_resolution;
+                }
+            }
+            else if (width != width_ || height != height_ || bits != bits_ || format != format_ || compression != compression_)
+            {
+                return false;
+            }
+
+            uint64_t bytes = 0;
+            for (size_t s = 0; s < page.offsets.size(); ++s)
+            {
+                if (!InBounds(page.offsets[s], page.counts[s]))
+                    return false;
+                bytes += page.counts[s];
+            }
+            if (!Compressed() && bytes < PageBytes())
+                return false;
+
+            pages_.push_back(std::move(page));
+            const uint64_t next = ifd + count_bytes + entries * entry_bytes;
+            ifd = big_ ? Get<uint64_t>(next) : Get<uint32_t>(next);
+        }
+
+        return !pages_.empty();
+    }
+
+    std::string path_;
+    const unsigned char *data_ = nullptr;
+    size_t size_ = 0;
+    bool big_ = false;
+    uint64_t last_ifd_ = 0;
+    size_t width_ = 0;
+    size_t height_ = 0;
+    uint16_t bits_ = 8;
+    uint16_t format_ = SAMPLEFORMAT_UINT;
+    uint16_t compression_ = COMPRESSION_NONE;
+    double x_spacing_ = 1.0;
+    double y_spacing_ = 1.0;
+    std::vector<Page> pages_;
+};
@@ -6,16 +6,17 @@
 #include <itkSubtractImageFilter.h>
 #include <itkClampImageFilter.h>
 
-kImageType::Pointer SubtractConstantClamped(kImageType::Pointer img, kPixelType constant)
+template <class TImage>
+itk::SmartPointer<TImage> SubtractConstantClamped(itk::SmartPointer<TImage> img, typename TImage::PixelType constant)
 {
-    using SubtractImageFilterType = itk::SubtractImageFilter<kImageType, kImageType, kImageType>;
-    SubtractImageFilterType::Pointer subtract_filter = SubtractImageFilterType::New();
+    using SubtractImageFilterType = itk::SubtractImageFilter<TImage, TImage, TImage>;
+    typename SubtractImageFilterType::Pointer subtract_filter = SubtractImageFilterType::New();
     subtract_filter->SetInput(img);
     subtract_filter->SetConstant2(constant);
     subtract_filter->Update();
 
-    using ClampFilterType = itk::ClampImageFilter<kImageType, kImageType>;
-    ClampFilterType::Pointer clamp_filter = ClampFilterType::New();
+    using ClampFilterType = itk::ClampImageFilter<TImage, TImage>;
+    typename ClampFilterType::Pointer clamp_filter = ClampFilterType::New();
     clamp_filter->SetInput(subtract_filter->GetOutput());
     clamp_filter->SetBounds(0.0, 1.0);
     clamp_filter->Update();
@@ -23,10 +24,11 @@ kImageType::Pointer SubtractConstantClamped(kImageType::Pointer img, kPixelType
     return clamp_filter->GetOutput();
 }
 
-kImageType::Pointer SubtractConstant(kImageType::Pointer img, kPixelType constant)
+template <class TImage>
+itk::SmartPointer<TImage> SubtractConstant(itk::SmartPointer<TImage> img, typename TImage::PixelType constant)
 {
-    using SubtractImageFilterType = itk::SubtractImageFilter<kImageType, kImageType, kImageType>;
-    SubtractImageFilterType::Pointer subtract_filter = SubtractImageFilterType::New();
+    using SubtractImageFilterType = itk::SubtractImageFilter<TImage, TImage, TImage>;
+    typename SubtractImageFilterType::Pointer subtract_filter = SubtractImageFilterType::New();
     subtract_filter->SetInput(img);
     subtract_filter->SetConstant2(constant);
     subtract_filter->Update();
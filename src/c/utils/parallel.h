@@ -0,0 +1,64 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <vector>
+#include <itkMultiThreaderBase.h>
+
+// Number of contiguous ranges a loop over count elements is split into: one per thread,
+// but no more than keeps every range at least min_range elements long
+unsigned int ParallelRangeCount(size_t count, unsigned int threads, size_t min_range=32768)
+{
+    size_t ranges = std::min<size_t>(std::max(1u, threads), (count + min_range - 1) / min_range);
+    return static_cast<unsigned int>(std::max<size_t>(ranges, 1));
+}
+
+// Calls f(begin, end) on contiguous, non-empty ranges covering [0, count) using ITK's thread
+// pool. Small loops run on the calling thread.
+template <class F>
+void ParallelFor(size_t count, unsigned int threads, F f, size_t min_range=32768)
+{
+    unsigned int ranges = ParallelRangeCount(count, threads, min_range);
+    if (ranges == 1)
+    {
+        f(size_t(0), count);
+        return;
+    }
+
+    // rounding the range length up can leave the last ranges with nothing to do, e.g. 5
+    // elements in 4 ranges of 2, so only as many ranges as the length needs are run
+    const size_t step = (count + ranges - 1) / ranges;
+    ranges = static_cast<unsigned int>((count + step - 1) / step);
+    itk::MultiThreaderBase::Pointer threader = itk::MultiThreaderBase::New();
+    threader->SetNumberOfWorkUnits(ranges);
+    threader->ParallelizeArray(0, ranges, [&](itk::SizeValueType r) {
+        f(r * step, std::min(count, (r + 1) * step));
+    }, nullptr);
+}
+
+// Accumulates N sums over contiguous ranges covering [0, count), with f(begin, end, sums)
+// adding to the sums of its range. Partial sums are combined in range order, so the result
+// does not depend on how the threads were scheduled.
+template <size_t N, class F>
+std::array<double, N> ParallelSums(size_t count, unsigned int threads, F f)
+{
+    const unsigned int ranges = ParallelRangeCount(count, threads);
+    std::vector<std::array<double, N>> partial(ranges);
+    for (std::array<double, N> &sums : partial)
+        sums.fill(0.0);
+
+    const size_t step = std::max<size_t>(1, (count + ranges - 1) / ranges);
+    ParallelFor(count, threads, [&](size_t begin, size_t end) {
+        f(begin, end, partial[begin / step]);
+    });
+
+    std::array<double, N> total;
+    total.fill(0.0);
+    for (const std::array<double, N> &sums : partial)
+    {
+        for (size_t i = 0; i < N; ++i)
+            total[i] += sums[i];
+    }
+    return total;
+}
@@ -0,0 +1,300 @@
+#pragma once
+
+#include "stream.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+// Writes an uncompressed TIFF or BigTIFF stack whose whole layout is fixed on Open: the header
+// and every IFD are written first, followed by the pixel data of all pages back to back, one
+// strip per page. Since the offset of every page is known in advance, pages can be written
+// with pwrite from any number of threads and in any order, without going through a single
+// libtiff handle. Tags and the ImageJ description are the same as TiffPageWriter's, so the
+// file opens in ImageJ like any other stack written by the tools.
+template <class TPixel>
+class ParallelTiffWriter
+{
+public:
+    ParallelTiffWriter() = default;
+    ParallelTiffWriter(const ParallelTiffWriter &) = delete;
+    ParallelTiffWriter &operator=(const ParallelTiffWriter &) = delete;
+
+    ~ParallelTiffWriter() { Close(); }
+
+    // metadata holds extra "key=value" lines appended to the ImageJ description
+    bool Open(const std::string &path, size_t width, size_t height, size_t pages, const std::array<double, kDimensions> &spacing, bool time_series = false, const std::string &metadata = "")
+    {
+        Close();
+        if (pages == 0)
+            return false;
+
+        width_ = width;
+        height_ = height;
+        pages_ = pages;
+        failed_ = false;
+
+        // BigTIFF for files of 3 GB or more, like Save3DImageAsTiffStackWithResolutions
+        const size_t size_threshold = static_cast<size_t>(3.0 * 1024 * 1024 * 1024);
+        big_ = PageBytes() * pages_ >= size_threshold;
+
+        std::vector<unsigned char> layout = Layout(spacing, ImageJDescription(pages, spacing[2], time_series, metadata));
+
+        fd_ = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd_ < 0)
+            return false;
+
+        // the file gets its final size up front, so pages can land anywhere in it
+        if (!WriteAt(layout.data(), layout.size(), 0) || ftruncate(fd_, static_cast<off_t>(data_offset_ + PageBytes() * pages_)) != 0)
+        {
+            Close();
+            return false;
+        }
+        return true;
+    }
+
+    size_t PageBytes() const { return width_ * height_ * sizeof(TPixel); }
+
+    // Converts page like WriteImageFile and writes it in place. Different pages may be
+    // written concurrently.
+    template <class TIn>
+    bool WritePage(size_t page, const TIn *data, bool scale = true)
+    {
+        if (fd_ < 0 || page >= pages_ || failed_)
+            return false;
+
+        const size_t count = width_ * height_;
+        const size_t chunk = std::max<size_t>(1, std::min(count, kWriteBytes / sizeof(TPixel)));
+        const uint64_t page_offset = data_offset_ + page * PageBytes();
+
+        std::vector<TPixel> buffer(chunk);
+        for (size_t first = 0; first < count; first += chunk)
+        {
+            const size_t n = std::min(chunk, count - first);
+            ConvertRange(data + first, buffer.data(), n, scale);
+            if (!WriteAt(buffer.data(), n * sizeof(TPixel), page_offset + first * sizeof(TPixel)))
+            {
+                failed_ = true;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Returns false if any page could not be written
+    bool Close()
+    {
+        if (fd_ >= 0 && close(fd_) != 0)
+            failed_ = true;
+        fd_ = -1;
+        return !failed_;
+    }
+
+private:
+    // pages are converted and written a few MB at a time
+    static constexpr size_t kWriteBytes = 4 * 1024 * 1024;
+
+    // pixel data starts on a file system block
+    static constexpr uint64_t kDataAlignment = 4096;
+
+    // TIFF field types
+    enum : uint16_t
+    {
+        kAscii = 2,
+        kShort = 3,
+        kLong = 4,
+        kRational = 5,
+        kLong8 = 16
+    };
+
+    struct Entry
+    {
+        uint16_t tag;
+        uint16_t type;
+        uint64_t count;
+        std::vector<unsigned char> value;
+    };
+
+    static void Put(unsigned char *out, uint64_t value, size_t bytes)
+    {
+        for (size_t i = 0; i < bytes; ++i)
+            out[i] = static_cast<unsigned char>(value >> (8 * i));
+    }
+
+    static std::vector<unsigned char> Bytes(uint64_t value, size_t bytes)
+    {
+        std::vector<unsigned char> out(bytes);
+        Put(out.data(), value, bytes);
+        return out;
+    }
+
+    // Positive value as a fraction, scaled by powers of 8 like libtiff does
+    static std::vector<unsigned char> Rational(double value)
+    {
+        uint64_t denominator = 1;
+        if (value > 0)
+        {
+            while (value < double(1L << (31 - 3)) && denominator < (1UL << (31 - 3)))
+            {
+                value *= 1 << 3;
+                denominator *= 1 << 3;
+            }
+        }
+        std::vector<unsigned char> out(8);
+        Put(out.data(), static_cast<uint32_t>(std::max(value, 0.0) + 0.5), 4);
+        Put(out.data() + 4, denominator, 4);
+        return out;
+    }
+
+    // Entries of one page's IFD, sorted by tag; the strip offset is patched in by Layout
+    std::vector<Entry> PageEntries(const std::array<double, kDimensions> &spacing, const std::string &description, bool first) const
+    {
+        const uint16_t offset_type = big_ ? kLong8 : kLong;
+        const size_t offset_bytes = big_ ? 8 : 4;
+
+        std::vector<Entry> entries = {
+            {TIFFTAG_IMAGEWIDTH, kLong, 1, Bytes(width_, 4)},
+            {TIFFTAG_IMAGELENGTH, kLong, 1, Bytes(height_, 4)},
+            {TIFFTAG_BITSPERSAMPLE, kShort, 1, Bytes(sizeof(TPixel) * 8, 2)},
+            {TIFFTAG_COMPRESSION, kShort, 1, Bytes(COMPRESSION_NONE, 2)},
+            {TIFFTAG_PHOTOMETRIC, kShort, 1, Bytes(PHOTOMETRIC_MINISBLACK, 2)},
+        };
+        if (first)
+        {
+            std::vector<unsigned char> text(description.begin(), description.end());
+            text.push_back(0);
+            entries.push_back({TIFFTAG_IMAGEDESCRIPTION, kAscii, text.size(), text});
+        }
+        entries.push_back({TIFFTAG_STRIPOFFSETS, offset_type, 1, Bytes(0, offset_bytes)});
+        entries.push_back({TIFFTAG_ORIENTATION, kShort, 1, Bytes(ORIENTATION_TOPLEFT, 2)});
+        entries.push_back({TIFFTAG_SAMPLESPERPIXEL, kShort, 1, Bytes(1, 2)});
+        entries.push_back({TIFFTAG_ROWSPERSTRIP, kLong, 1, Bytes(height_, 4)});
+        entries.push_back({TIFFTAG_STRIPBYTECOUNTS, offset_type, 1, Bytes(PageBytes(), offset_bytes)});
+        entries.push_back({TIFFTAG_XRESOLUTION, kRational, 1, Rational(1.0 / spacing[0])});
+        entries.push_back({TIFFTAG_YRESOLUTION, kRational, 1, Rational(1.0 / spacing[1])});
+        entries.push_back({TIFFTAG_PLANARCONFIG, kShort, 1, Bytes(PLANARCONFIG_CONTIG, 2)});
+        entries.push_back({TIFFTAG_RESOLUTIONUNIT, kShort, 1, Bytes(RESUNIT_NONE, 2)});
+        return entries;
+    }
+
+    // Bytes of an IFD with its out-of-line values, kept word aligned
+    size_t IFDBytes(const std::vector<Entry> &entries) const
+    {
+        const size_t inline_bytes = big_ ? 8 : 4;
+        size_t bytes = (big_ ? 8 : 2) + entries.size() * (big_ ? 20 : 12) + (big_ ? 8 : 4);
+        for (const Entry &entry : entries)
+        {
+            if (entry.value.size() > inline_bytes)
+                bytes += (entry.value.size() + 1) & ~size_t(1);
+        }
+        return (bytes + 7) & ~size_t(7);
+    }
+
+    // Header and every IFD, with the strip offsets pointing at the pages that follow them
+    std::vector<unsigned char> Layout(const std::array<double, kDimensions> &spacing, const std::string &description)
+    {
+        const std::vector<Entry> first_entries = PageEntries(spacing, description, true);
+        const std::vector<Entry> other_entries = PageEntries(spacing, description, false);
+        const size_t header_bytes = big_ ? 16 : 8;
+        const size_t first_bytes = IFDBytes(first_entries);
+        const size_t other_bytes = IFDBytes(other_entries);
+
+        const uint64_t ifds_end = header_bytes + first_bytes + (pages_ > 1 ? (pages_ - 1) * other_bytes : 0);
+        data_offset_ = (ifds_end + kDataAlignment - 1) / kDataAlignment * kDataAlignment;
+
+        std::vector<unsigned char> layout(data_offset_, 0);
+        layout[0] = 'I';
+        layout[1] = 'I';
+        if (big_)
+        {
+            Put(&layout[2], 43, 2);
+            Put(&layout[4], 8, 2);
+            Put(&layout[8], header_bytes, 8);
+        }
+        else
+        {
+            Put(&layout[2], 42, 2);
+            Put(&layout[4], header_bytes, 4);
+        }
+
+        const size_t inline_bytes = big_ ? 8 : 4;
+        const size_t count_bytes = big_ ? 8 : 2;
+        const size_t entry_bytes = big_ ? 20 : 12;
+        const size_t offset_bytes = big_ ? 8 : 4;
+
+        uint64_t ifd = header_bytes;
+        for (size_t page = 0; page < pages_; ++page)
+        {
+            std::vector<Entry> entries = (page == 0) ? first_entries : other_entries;
+            const uint64_t next = (page + 1 < pages_) ? ifd + ((page == 0) ? first_bytes : other_bytes) : 0;
+            for (Entry &entry : entries)
+            {
+                if (entry.tag == TIFFTAG_STRIPOFFSETS)
+                    Put(entry.value.data(), data_offset_ + page * PageBytes(), offset_bytes);
+            }
+
+            unsigned char *out = &layout[ifd];
+            Put(out, entries.size(), count_bytes);
+            uint64_t extra = ifd + count_bytes + entries.size() * entry_bytes + offset_bytes;
+            for (size_t e = 0; e < entries.size(); ++e)
+            {
+                const Entry &entry = entries[e];
+                unsigned char *field = out + count_bytes + e * entry_bytes;
+                Put(field, entry.tag, 2);
+                Put(field + 2, entry.type, 2);
+                Put(field + 4, entry.count, big_ ? 8 : 4);
+                unsigned char *value = field + (big_ ? 12 : 8);
+                if (entry.value.size() <= inline_bytes)
+                {
+                    std::copy(entry.value.begin(), entry.value.end(), value);
+                }
+                else
+                {
+                    Put(value, extra, offset_bytes);
+                    std::copy(entry.value.begin(), entry.value.end(), &layout[extra]);
+                    extra += (entry.value.size() + 1) & ~uint64_t(1);
+                }
+            }
+            Put(out + count_bytes + entries.size() * entry_bytes, next, offset_bytes);
+
+            ifd += (page == 0) ? first_bytes : other_bytes;
+        }
+
+        return layout;
+    }
+
+    bool WriteAt(const void *data, size_t bytes, uint64_t offset) const
+    {
+        const char *p = static_cast<const char *>(data);
+        while (bytes > 0)
+        {
+            const ssize_t written = pwrite(fd_, p, bytes, static_cast<off_t>(offset));
+            if (written < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                return false;
+            }
+            p += written;
+            bytes -= static_cast<size_t>(written);
+            offset += static_cast<uint64_t>(written);
+        }
+        return true;
+    }
+
+    int fd_ = -1;
+    size_t width_ = 0;
+    size_t height_ = 0;
+    size_t pages_ = 0;
+    bool big_ = false;
+    uint64_t data_offset_ = 0;
+    std::atomic<bool> failed_{false};
+};
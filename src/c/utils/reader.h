@@ -1,12 +1,19 @@
 #pragma once
 
 #include "defines.h"
+#include "mapped_tiff.h"
+#include "parallel.h"
 #include "utils.h"
 
 #include <itkImageFileReader.h>
 #include <itkImageFileWriter.h>
 #include <itkImageIOBase.h>
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <limits>
+
 template <class TImageIn, class TImageOut>
 typename TImageOut::Pointer ReadAndConvertImage(const char *file_path, bool scale=true)
 {
@@ -122,9 +129,58 @@ typename TImageOut::Pointer ReadImage(const char *file_path, const itk::IOCompon
   return nullptr;
 }
 
+// Reads a TIFF stack from a memory mapping of the file, decoding and converting its pages in
+// parallel straight into disjoint planes of the one output image, so loading holds a single
+// volume, sweeps it once and scales with the threads until storage is saturated. Returns
+// nullptr if the file cannot be mapped, so the caller can fall back to ITK.
+template <class TImage>
+itk::SmartPointer<TImage> ReadMappedTiff(const std::string &file_path, bool verbose=false, bool scale=true)
+{
+  MappedTiff tiff;
+  if (!tiff.Open(file_path))
+    return nullptr;
+
+  typename TImage::SizeType size;
+  size[0] = tiff.Width();
+  size[1] = tiff.Height();
+  size[2] = tiff.Pages();
+  typename TImage::RegionType region;
+  region.SetSize(size);
+
+  typename TImage::SpacingType spacing;
+  spacing[0] = tiff.XSpacing();
+  spacing[1] = tiff.YSpacing();
+  spacing[2] = 1.0;
+
+  itk::SmartPointer<TImage> image = TImage::New();
+  image->SetRegions(region);
+  image->SetSpacing(spacing);
+  image->Allocate();
+
+  if (verbose)
+    std::cout << "Mapped " << tiff.Pages() << (tiff.Compressed() ? " compressed" : "") << " pages of " << tiff.BitsPerSample() << "-bit samples from " << file_path << std::endl;
+
+  const size_t plane_size = size[0] * size[1];
+  typename TImage::PixelType *buffer = image->GetBufferPointer();
+  std::atomic<bool> failed(false);
+  ParallelFor(size[2], itk::MultiThreaderBase::GetGlobalDefaultNumberOfThreads(), [&](size_t begin, size_t end) {
+    if (!tiff.ConvertPages(begin, end, buffer + begin * plane_size, scale))
+      failed = true;
+  }, 1);
+
+  if (failed)
+    return nullptr;
+  return image;
+}
+
 template <class TImage>
 itk::SmartPointer<TImage> ReadImageFile(std::string file_path, bool verbose=false, bool scale=true)
 {
+  // TIFF stacks skip ITK's read and convert copies and are decoded in parallel
+  itk::SmartPointer<TImage> mapped = ReadMappedTiff<TImage>(file_path, verbose, scale);
+  if (mapped != nullptr)
+    return mapped;
+
   itk::ImageIOBase::Pointer image_io = itk::ImageIOFactory::CreateImageIO(file_path.c_str(), itk::CommonEnums::IOFileMode::ReadMode);
 
   image_io->SetFileName(file_path.c_str());
@@ -164,3 +220,113 @@ itk::SmartPointer<TImage> ReadImageFile(std::string file_path, bool verbose=fals
 
   return nullptr;
 }
+
+// Reads the size and spacing of an image from its header without loading the pixel data
+template <class TImage>
+bool ReadImageGeometry(std::string file_path, typename TImage::SizeType &size, typename TImage::SpacingType &spacing)
+{
+  itk::ImageIOBase::Pointer image_io = itk::ImageIOFactory::CreateImageIO(file_path.c_str(), itk::CommonEnums::IOFileMode::ReadMode);
+  if (image_io == nullptr)
+  {
+    return false;
+  }
+
+  image_io->SetFileName(file_path.c_str());
+  image_io->ReadImageInformation();
+
+  const unsigned int image_dimension = image_io->GetNumberOfDimensions();
+  for (unsigned int i = 0; i < TImage::ImageDimension; ++i)
+  {
+    size[i] = (i < image_dimension) ? image_io->GetDimensions(i) : 1;
+    spacing[i] = (i < image_dimension) ? image_io->GetSpacing(i) : 1.0;
+  }
+
+  return true;
+}
+
+// Bytes an image file occupies in memory while it is read: in its own pixel type as stored
+// in the file, and once converted to the pixel type of TImage
+template <class TImage>
+bool ReadImageFootprint(std::string file_path, size_t &file_bytes, size_t &converted_bytes)
+{
+  itk::ImageIOBase::Pointer image_io = itk::ImageIOFactory::CreateImageIO(file_path.c_str(), itk::CommonEnums::IOFileMode::ReadMode);
+  if (image_io == nullptr)
+  {
+    return false;
+  }
+
+  image_io->SetFileName(file_path.c_str());
+  image_io->ReadImageInformation();
+
+  const size_t pixels = image_io->GetImageSizeInPixels();
+  file_bytes = image_io->GetImageSizeInBytes();
+  converted_bytes = pixels * sizeof(typename TImage::PixelType);
+
+  return true;
+}
+
+// Converts a value given in the file's own pixel type, e.g. a fill value on the command line,
+// to TPixel the way ReadImageFile converts the file's pixels
+template <class TIn, class TPixel>
+TPixel ConvertFileValue(double value, bool scale=true)
+{
+  value = std::min(std::max(value, double(std::numeric_limits<TIn>::lowest())), double(std::numeric_limits<TIn>::max()));
+  if (std::numeric_limits<TIn>::is_integer)
+    value = std::round(value);
+
+  const TIn typed = static_cast<TIn>(value);
+  TPixel converted;
+  ConvertRange(&typed, &converted, 1, scale);
+  return converted;
+}
+
+// Converts value, given in the pixel type stored in file_path, like ReadImageFile would
+template <class TPixel>
+bool ReadFileValue(std::string file_path, double value, TPixel &converted, bool scale=true)
+{
+  itk::ImageIOBase::Pointer image_io = itk::ImageIOFactory::CreateImageIO(file_path.c_str(), itk::CommonEnums::IOFileMode::ReadMode);
+  if (image_io == nullptr)
+  {
+    return false;
+  }
+
+  image_io->SetFileName(file_path.c_str());
+  image_io->ReadImageInformation();
+
+  switch (image_io->GetComponentType())
+  {
+  case itk::IOComponentEnum::UCHAR:
+    converted = ConvertFileValue<unsigned char, TPixel>(value, scale);
+    return true;
+  case itk::IOComponentEnum::CHAR:
+    converted = ConvertFileValue<char, TPixel>(value, scale);
+    return true;
+  case itk::IOComponentEnum::USHORT:
+    converted = ConvertFileValue<unsigned short, TPixel>(value, scale);
+    return true;
+  case itk::IOComponentEnum::SHORT:
+    converted = ConvertFileValue<short, TPixel>(value, scale);
+    return true;
+  case itk::IOComponentEnum::UINT:
+    converted = ConvertFileValue<unsigned int, TPixel>(value, scale);
+    return true;
+  case itk::IOComponentEnum::INT:
+    converted = ConvertFileValue<int, TPixel>(value, scale);
+    return true;
+  case itk::IOComponentEnum::ULONG:
+    converted = ConvertFileValue<unsigned long int, TPixel>(value, scale);
+    return true;
+  case itk::IOComponentEnum::LONG:
+    converted = ConvertFileValue<long int, TPixel>(value, scale);
+    return true;
+  case itk::IOComponentEnum::FLOAT:
+    converted = ConvertFileValue<float, TPixel>(value, scale);
+    return true;
+  case itk::IOComponentEnum::DOUBLE:
+    converted = ConvertFileValue<double, TPixel>(value, scale);
+    return true;
+  default:
+    std::cerr << "Unknown and unsupported component type!" << std::endl;
+    return false;
+  }
+}
@@ -6,26 +6,36 @@
 #include <itkLinearInterpolateImageFunction.h>
 #include <itkScaleTransform.h>
 
-// TODO make this templated
-kImageType::Pointer Resampler(kImageType::Pointer image, kImageType::SpacingType out_spacing, bool verbose=false)
+// Size of an image with in_size voxels of in_spacing once resampled to out_spacing
+template <class TImage>
+typename TImage::SizeType ResampledSize(typename TImage::SizeType in_size, typename TImage::SpacingType in_spacing, typename TImage::SpacingType out_spacing)
 {
+  typename TImage::SizeType size;
+  for (unsigned int i=0; i<TImage::ImageDimension; ++i)
+  {
+    size[i] = in_size[i] * in_spacing[i] / out_spacing[i];
+  }
+  return size;
+}
+
+template <class TImage>
+itk::SmartPointer<TImage> Resampler(itk::SmartPointer<TImage> image, typename TImage::SpacingType out_spacing, bool verbose=false)
+{
+  constexpr unsigned int dimensions = TImage::ImageDimension;
+
   // set up resample filter
-  using FilterType = itk::ResampleImageFilter<kImageType, kImageType>;
-  FilterType::Pointer filter = FilterType::New();
+  using FilterType = itk::ResampleImageFilter<TImage, TImage>;
+  typename FilterType::Pointer filter = FilterType::New();
 
-  using InterpolatorType = itk::LinearInterpolateImageFunction<kImageType, double>;
-  InterpolatorType::Pointer interpolator = InterpolatorType::New();
+  using InterpolatorType = itk::LinearInterpolateImageFunction<TImage, double>;
+  typename InterpolatorType::Pointer interpolator = InterpolatorType::New();
   filter->SetInterpolator(interpolator);
   filter->SetOutputSpacing(out_spacing);
 
   // calculate size based on spacing
-  kImageType::SpacingType in_spacing = image->GetSpacing();
-  kImageType::SizeType in_size = image->GetLargestPossibleRegion().GetSize();
-  kImageType::SizeType size;
-  for (int i=0; i<kDimensions; ++i) // TODO figure out the dimensions from the type
-  {
-    size[i] = in_size[i] * in_spacing[i] / out_spacing[i];
-  }
+  typename TImage::SpacingType in_spacing = image->GetSpacing();
+  typename TImage::SizeType in_size = image->GetLargestPossibleRegion().GetSize();
+  typename TImage::SizeType size = ResampledSize<TImage>(in_size, in_spacing, out_spacing);
   filter->SetSize(size);
 
 /*
@@ -51,19 +61,19 @@ kImageType::Pointer Resampler(kImageType::Pointer image, kImageType::SpacingType
   if (verbose)
   {
     printf("In spacing: ");
-    for (int i=0; i<kDimensions; ++i)
+    for (unsigned int i=0; i<dimensions; ++i)
     {
       printf("%0.3f ", in_spacing[i]);
     }
 
     printf("\nOut spacing: ");
-    for (int i=0; i<kDimensions; ++i)
+    for (unsigned int i=0; i<dimensions; ++i)
     {
       printf("%0.3f ", out_spacing[i]);
     }
 
     printf("\nOut dimension: ");
-    for (int i=0; i<kDimensions; ++i)
+    for (unsigned int i=0; i<dimensions; ++i)
     {
       printf("%ld ", size[i]);
     }
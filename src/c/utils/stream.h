@@ -0,0 +1,583 @@
+#pragma once
+
+#include "defines.h"
+#include "parallel.h"
+#include "pipeline.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "itk_tiff.h"
+
+// Maps values from the full range of TIn to the full range of TOut with the clamping and
+// truncation of the IntensityWindowingImageFilter used by ConvertImage
+template <class TIn, class TOut>
+void ConvertRange(const TIn *in, TOut *out, size_t count)
+{
+    if (std::is_same<TIn, TOut>::value)
+    {
+        std::copy(in, in + count, out);
+        return;
+    }
+
+    double input_min, input_max, output_min, output_max;
+    GetRange<TIn>(input_min, input_max);
+    GetRange<TOut>(output_min, output_max);
+    const double scale = (output_max - output_min) / (input_max - input_min);
+    const double shift = output_min - input_min * scale;
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        const double value = double(in[i]);
+        if (value < input_min)
+            out[i] = static_cast<TOut>(output_min);
+        else if (value > input_max)
+            out[i] = static_cast<TOut>(output_max);
+        else
+            out[i] = static_cast<TOut>(value * scale + shift);
+    }
+}
+
+// Converts values with a plain cast, like the CastImageFilter ConvertImage uses when it does
+// not scale
+template <class TIn, class TOut>
+void CastRange(const TIn *in, TOut *out, size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+        out[i] = static_cast<TOut>(in[i]);
+}
+
+// Converts values like ConvertImage, scaled or cast
+template <class TIn, class TOut>
+void ConvertRange(const TIn *in, TOut *out, size_t count, bool scale)
+{
+    if (scale)
+        ConvertRange(in, out, count);
+    else
+        CastRange(in, out, count);
+}
+
+// Reads the pages of a TIFF stack one at a time into the working precision, scaled like
+// ReadImageFile (or cast when not scaling), so a stack can be processed without holding all of it in memory
+class TiffPageReader
+{
+public:
+    TiffPageReader() = default;
+    TiffPageReader(const TiffPageReader &) = delete;
+    TiffPageReader &operator=(const TiffPageReader &) = delete;
+
+    ~TiffPageReader() { Close(); }
+
+    bool Open(const std::string &path)
+    {
+        Close();
+        tiff_ = TIFFOpen(path.c_str(), "r");
+        if (tiff_ == nullptr)
+            return false;
+
+        uint32_t width = 0, height = 0;
+        uint16_t samples = 1;
+        TIFFGetField(tiff_, TIFFTAG_IMAGEWIDTH, &width);
+        TIFFGetField(tiff_, TIFFTAG_IMAGELENGTH, &height);
+        TIFFGetFieldDefaulted(tiff_, TIFFTAG_SAMPLESPERPIXEL, &samples);
+        TIFFGetFieldDefaulted(tiff_, TIFFTAG_BITSPERSAMPLE, &bits_);
+        TIFFGetFieldDefaulted(tiff_, TIFFTAG_SAMPLEFORMAT, &format_);
+
+        // only single channel, stripped stacks can be streamed
+        if (samples != 1 || TIFFIsTiled(tiff_) || width == 0 || height == 0)
+        {
+            Close();
+            return false;
+        }
+
+        width_ = width;
+        height_ = height;
+        pages_ = TIFFNumberOfDirectories(tiff_);
+        raw_.resize(width_ * height_ * ((bits_ + 7) / 8));
+        return true;
+    }
+
+    void Close()
+    {
+        if (tiff_ != nullptr)
+            TIFFClose(tiff_);
+        tiff_ = nullptr;
+    }
+
+    size_t Width() const { return width_; }
+    size_t Height() const { return height_; }
+    size_t Pages() const { return pages_; }
+
+    uint16_t BitsPerSample() const { return bits_; }
+    uint16_t SampleFormat() const { return format_; }
+    size_t PageBytes() const { return raw_.size(); }
+
+    // Reads one page of Width() x Height() pixels in the file's own sample type, PageBytes()
+    // bytes, without converting it
+    bool ReadRawPage(size_t page, void *out)
+    {
+        if (!SeekPage(page))
+            return false;
+
+        uint32_t width = 0, height = 0;
+        TIFFGetField(tiff_, TIFFTAG_IMAGEWIDTH, &width);
+        TIFFGetField(tiff_, TIFFTAG_IMAGELENGTH, &height);
+        if (width != width_ || height != height_)
+        {
+            std::cerr << "Page " << page << " is " << width << "x" << height << " but the stack is " << width_ << "x" << height_ << std::endl;
+            return false;
+        }
+
+        // every strip must decode to its full size, so a truncated file never leaves stale
+        // data from an earlier page in the buffer
+        uint32_t rows_per_strip = height_;
+        TIFFGetFieldDefaulted(tiff_, TIFFTAG_ROWSPERSTRIP, &rows_per_strip);
+        rows_per_strip = std::max<uint32_t>(1, std::min<uint32_t>(rows_per_strip, height_));
+        const size_t row_bytes = raw_.size() / height_;
+
+        unsigned char *bytes_out = static_cast<unsigned char *>(out);
+        size_t offset = 0;
+        for (uint32_t strip = 0; strip < TIFFNumberOfStrips(tiff_) && offset < raw_.size(); ++strip)
+        {
+            const size_t expected = std::min<size_t>(rows_per_strip * row_bytes, raw_.size() - offset);
+            tmsize_t bytes = TIFFReadEncodedStrip(tiff_, strip, bytes_out + offset, expected);
+            if (bytes < 0 || static_cast<size_t>(bytes) != expected)
+            {
+                std::cerr << "Strip " << strip << " of page " << page << " is truncated" << std::endl;
+                return false;
+            }
+            offset += bytes;
+        }
+        if (offset != raw_.size())
+        {
+            std::cerr << "Page " << page << " is missing strips" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    // Reads one page of Width() x Height() pixels
+    bool ReadPage(size_t page, kPixelType *out, bool scale = true)
+    {
+        if (!ReadRawPage(page, raw_.data()))
+            return false;
+
+        const size_t count = width_ * height_;
+        const bool is_float = (format_ == SAMPLEFORMAT_IEEEFP);
+        const bool is_signed = (format_ == SAMPLEFORMAT_INT);
+        switch (bits_)
+        {
+        case 8:
+            if (is_signed)
+                ConvertRange(reinterpret_cast<const char *>(raw_.data()), out, count, scale);
+            else
+                ConvertRange(reinterpret_cast<const unsigned char *>(raw_.data()), out, count, scale);
+            return true;
+        case 16:
+            if (is_signed)
+                ConvertRange(reinterpret_cast<const short *>(raw_.data()), out, count, scale);
+            else
+                ConvertRange(reinterpret_cast<const unsigned short *>(raw_.data()), out, count, scale);
+            return true;
+        case 32:
+            if (is_float)
+                ConvertRange(reinterpret_cast<const float *>(raw_.data()), out, count, scale);
+            else if (is_signed)
+                ConvertRange(reinterpret_cast<const int *>(raw_.data()), out, count, scale);
+            else
+                ConvertRange(reinterpret_cast<const unsigned int *>(raw_.data()), out, count, scale);
+            return true;
+        case 64:
+            if (!is_float)
+                break;
+            ConvertRange(reinterpret_cast<const double *>(raw_.data()), out, count, scale);
+            return true;
+        }
+
+        std::cerr << "Unsupported TIFF sample format: " << bits_ << " bits" << std::endl;
+        return false;
+    }
+
+private:
+    // Makes page the current directory. The next page is reached with TIFFReadDirectory from
+    // the current one, while TIFFSetDirectory walks the IFD chain from the first page, which
+    // would make a sequential read of the stack quadratic in its depth, so it is only used
+    // to seek.
+    bool SeekPage(size_t page)
+    {
+        if (tiff_ == nullptr)
+            return false;
+
+        const size_t current = TIFFCurrentDirectory(tiff_);
+        if (page == current)
+            return true;
+        if (page == current + 1)
+            return TIFFReadDirectory(tiff_) == 1;
+        return TIFFSetDirectory(tiff_, static_cast<tdir_t>(page)) == 1;
+    }
+
+    TIFF *tiff_ = nullptr;
+    size_t width_ = 0;
+    size_t height_ = 0;
+    size_t pages_ = 0;
+    uint16_t bits_ = 8;
+    uint16_t format_ = SAMPLEFORMAT_UINT;
+    std::vector<unsigned char> raw_;
+};
+
+// ImageJ description of the first page of a stack, so ImageJ opens the pages as z slices or,
+// for a time series, as frames. metadata holds extra "key=value" lines.
+std::string ImageJDescription(size_t pages, double z_spacing, bool time_series, const std::string &metadata)
+{
+    char description[512];
+    if (time_series)
+        snprintf(description, sizeof(description),
+                 "ImageJ=1.53\nimages=%zu\nframes=%zu\nunit=pixel\nhyperstack=false\nmode=grayscale\nloop=false",
+                 pages, pages);
+    else
+        snprintf(description, sizeof(description),
+                 "ImageJ=1.53\nimages=%zu\nslices=%zu\nspacing=%.6f\nunit=pixel\nhyperstack=false\nmode=grayscale\nloop=false",
+                 pages, pages, z_spacing);
+
+    std::string full_description = description;
+    if (!metadata.empty())
+        full_description += "\n" + metadata;
+    return full_description;
+}
+
+// Looks up the libtiff scheme of a --compression name (none, lzw, deflate or zstd). Returns
+// false for unknown names and for codecs the TIFF library was built without.
+bool ParseTiffCompression(const std::string &name, uint16_t &compression)
+{
+    if (name == "none")
+        compression = COMPRESSION_NONE;
+    else if (name == "lzw")
+        compression = COMPRESSION_LZW;
+    else if (name == "deflate")
+        compression = COMPRESSION_ADOBE_DEFLATE;
+    else if (name == "zstd")
+        compression = COMPRESSION_ZSTD;
+    else
+        return false;
+
+    return compression == COMPRESSION_NONE || TIFFIsCODECConfigured(compression);
+}
+
+// Tags the current directory with a compression scheme. Integer pixels also get horizontal
+// differencing, which makes smooth microscopy data compress much better.
+template <class TPixel>
+void SetCompressionTags(TIFF *tiff, uint16_t compression)
+{
+    TIFFSetField(tiff, TIFFTAG_COMPRESSION, compression);
+    if (compression != COMPRESSION_NONE && std::is_integral<TPixel>::value)
+        TIFFSetField(tiff, TIFFTAG_PREDICTOR, PREDICTOR_HORIZONTAL);
+}
+
+// Growable in-memory file for libtiff, so a strip can be compressed by any thread without
+// touching the output file
+class MemoryTiff
+{
+public:
+    TIFF *Open(const char *mode)
+    {
+        return TIFFClientOpen("memory", mode, reinterpret_cast<thandle_t>(this), Read, Write, Seek, Close, Size, Map, Unmap);
+    }
+
+    const unsigned char *Data() const { return data_.data(); }
+    size_t Size() const { return data_.size(); }
+
+private:
+    static MemoryTiff *Self(thandle_t handle) { return reinterpret_cast<MemoryTiff *>(handle); }
+
+    static tmsize_t Read(thandle_t handle, void *buffer, tmsize_t size)
+    {
+        MemoryTiff *self = Self(handle);
+        const size_t count = std::min<size_t>(size, self->data_.size() - std::min(self->position_, self->data_.size()));
+        if (count > 0)
+            std::memcpy(buffer, self->data_.data() + self->position_, count);
+        self->position_ += count;
+        return static_cast<tmsize_t>(count);
+    }
+
+    static tmsize_t Write(thandle_t handle, void *buffer, tmsize_t size)
+    {
+        MemoryTiff *self = Self(handle);
+        if (self->position_ + size > self->data_.size())
+            self->data_.resize(self->position_ + size);
+        std::memcpy(self->data_.data() + self->position_, buffer, size);
+        self->position_ += size;
+        return size;
+    }
+
+    static toff_t Seek(thandle_t handle, toff_t offset, int whence)
+    {
+        MemoryTiff *self = Self(handle);
+        if (whence == SEEK_CUR)
+            offset += self->position_;
+        else if (whence == SEEK_END)
+            offset += self->data_.size();
+        self->position_ = offset;
+        return offset;
+    }
+
+    static int Close(thandle_t) { return 0; }
+    static toff_t Size(thandle_t handle) { return Self(handle)->data_.size(); }
+    static int Map(thandle_t, void **, toff_t *) { return 0; }
+    static void Unmap(thandle_t, void *, toff_t) {}
+
+    std::vector<unsigned char> data_;
+    size_t position_ = 0;
+};
+
+// Compresses rows x width pixels as a single TIFF strip, returning the encoded bytes that
+// TIFFWriteRawStrip expects. The pixels may be overwritten by the predictor.
+template <class TPixel>
+bool EncodeStrip(TPixel *pixels, size_t width, size_t rows, uint16_t compression, std::vector<unsigned char> &encoded)
+{
+    MemoryTiff memory;
+    TIFF *tiff = memory.Open("wm");
+    if (tiff == nullptr)
+        return false;
+
+    TIFFSetField(tiff, TIFFTAG_IMAGEWIDTH, static_cast<uint32_t>(width));
+    TIFFSetField(tiff, TIFFTAG_IMAGELENGTH, static_cast<uint32_t>(rows));
+    TIFFSetField(tiff, TIFFTAG_SAMPLESPERPIXEL, 1);
+    TIFFSetField(tiff, TIFFTAG_BITSPERSAMPLE, sizeof(TPixel) * 8);
+    TIFFSetField(tiff, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISBLACK);
+    TIFFSetField(tiff, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+    TIFFSetField(tiff, TIFFTAG_ROWSPERSTRIP, static_cast<uint32_t>(rows));
+    SetCompressionTags<TPixel>(tiff, compression);
+
+    // the strip is appended to the memory file as soon as it is encoded
+    bool encoded_strip = TIFFWriteEncodedStrip(tiff, 0, pixels, width * rows * sizeof(TPixel)) >= 0;
+    uint64_t *offsets = nullptr;
+    uint64_t *byte_counts = nullptr;
+    uint64_t offset = 0, byte_count = 0;
+    if (encoded_strip && TIFFGetField(tiff, TIFFTAG_STRIPOFFSETS, &offsets) && TIFFGetField(tiff, TIFFTAG_STRIPBYTECOUNTS, &byte_counts))
+    {
+        offset = offsets[0];
+        byte_count = byte_counts[0];
+    }
+    else
+    {
+        encoded_strip = false;
+    }
+    TIFFClose(tiff);
+
+    if (!encoded_strip || offset + byte_count > memory.Size())
+        return false;
+
+    encoded.assign(memory.Data() + offset, memory.Data() + offset + byte_count);
+    return true;
+}
+
+// Appends pages to a TIFF stack of TPixel, converted like WriteImageFile and tagged like
+// Save3DImageAsTiffStackWithResolutions. Pages are z slices, or time points when the stack is
+// opened as a time series. Each page is converted a strip at a time into one reused buffer
+// and written with TIFFWriteEncodedStrip, so no converted copy of a page or volume is made.
+// With a compression scheme, the strips of a page are converted and compressed in parallel
+// and a writer thread appends them in order while the next page is being compressed.
+template <class TPixel>
+class TiffPageWriter
+{
+public:
+    TiffPageWriter() = default;
+    TiffPageWriter(const TiffPageWriter &) = delete;
+    TiffPageWriter &operator=(const TiffPageWriter &) = delete;
+
+    ~TiffPageWriter() { Close(); }
+
+    // metadata holds extra "key=value" lines appended to the ImageJ description, compression
+    // is a libtiff scheme such as the one ParseTiffCompression returns
+    bool Open(const std::string &path, size_t width, size_t height, size_t pages, const std::array<double, kDimensions> &spacing, bool time_series = false, const std::string &metadata = "", uint16_t compression = COMPRESSION_NONE)
+    {
+        Close();
+
+        // BigTIFF for files of 3 GB or more, like Save3DImageAsTiffStackWithResolutions
+        const size_t estimated_size = width * height * pages * sizeof(TPixel);
+        const size_t size_threshold = static_cast<size_t>(3.0 * 1024 * 1024 * 1024);
+        tiff_ = TIFFOpen(path.c_str(), (estimated_size >= size_threshold) ? "w8" : "w");
+        if (tiff_ == nullptr)
+            return false;
+
+        width_ = width;
+        height_ = height;
+        pages_ = pages;
+        spacing_ = spacing;
+        time_series_ = time_series;
+        metadata_ = metadata;
+        compression_ = compression;
+        written_ = 0;
+        failed_ = false;
+
+        // compressed strips are smaller so that every thread gets some of each page
+        const size_t strip_bytes = (compression_ == COMPRESSION_NONE) ? kStripBytes : kCompressedStripBytes;
+        const size_t row_bytes = std::max<size_t>(1, width_ * sizeof(TPixel));
+        rows_per_strip_ = std::max<size_t>(1, std::min(height_, strip_bytes / row_bytes));
+
+        if (compression_ == COMPRESSION_NONE)
+        {
+            buffer_.resize(rows_per_strip_ * width_);
+        }
+        else
+        {
+            buffer_.clear();
+            queue_.reset(new BoundedQueue<EncodedPage>(2));
+            write_stage_ = std::thread([this]() { WriteEncodedPages(); });
+        }
+        return true;
+    }
+
+    // Writes the next page of width x height pixels
+    template <class TIn>
+    bool WritePage(const TIn *page, bool scale = true)
+    {
+        if (tiff_ == nullptr || written_ >= pages_ || failed_)
+            return false;
+
+        if (compression_ != COMPRESSION_NONE)
+            return CompressPage(page, scale);
+
+        SetPageTags(written_);
+        for (size_t row = 0, strip = 0; row < height_; row += rows_per_strip_, ++strip)
+        {
+            const size_t count = std::min(rows_per_strip_, height_ - row) * width_;
+            ConvertRange(page + row * width_, buffer_.data(), count, scale);
+            if (TIFFWriteEncodedStrip(tiff_, static_cast<uint32_t>(strip), buffer_.data(), count * sizeof(TPixel)) < 0)
+            {
+                failed_ = true;
+                return false;
+            }
+        }
+
+        if (++written_ < pages_ && TIFFWriteDirectory(tiff_) == 0)
+        {
+            failed_ = true;
+            return false;
+        }
+
+        return true;
+    }
+
+    // Returns false if any page could not be written
+    bool Close()
+    {
+        if (queue_)
+        {
+            queue_->Close();
+            write_stage_.join();
+            queue_.reset();
+        }
+        if (tiff_ != nullptr)
+            TIFFClose(tiff_);
+        tiff_ = nullptr;
+        return !failed_;
+    }
+
+private:
+    // strips of a few MB keep the writes large while the buffer stays small
+    static constexpr size_t kStripBytes = 4 * 1024 * 1024;
+    static constexpr size_t kCompressedStripBytes = 256 * 1024;
+
+    // encoded strips of one page
+    using EncodedPage = std::vector<std::vector<unsigned char>>;
+
+    void SetPageTags(size_t page)
+    {
+        TIFFSetField(tiff_, TIFFTAG_IMAGEWIDTH, static_cast<uint32_t>(width_));
+        TIFFSetField(tiff_, TIFFTAG_IMAGELENGTH, static_cast<uint32_t>(height_));
+        TIFFSetField(tiff_, TIFFTAG_SAMPLESPERPIXEL, 1);
+        TIFFSetField(tiff_, TIFFTAG_BITSPERSAMPLE, sizeof(TPixel) * 8);
+        TIFFSetField(tiff_, TIFFTAG_ORIENTATION, ORIENTATION_TOPLEFT);
+        TIFFSetField(tiff_, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISBLACK);
+        TIFFSetField(tiff_, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+        TIFFSetField(tiff_, TIFFTAG_ROWSPERSTRIP, static_cast<uint32_t>(rows_per_strip_));
+        TIFFSetField(tiff_, TIFFTAG_XRESOLUTION, 1.0 / spacing_[0]);
+        TIFFSetField(tiff_, TIFFTAG_YRESOLUTION, 1.0 / spacing_[1]);
+        TIFFSetField(tiff_, TIFFTAG_RESOLUTIONUNIT, RESUNIT_NONE);
+        if (compression_ != COMPRESSION_NONE)
+            SetCompressionTags<TPixel>(tiff_, compression_);
+
+        if (page == 0)
+            TIFFSetField(tiff_, TIFFTAG_IMAGEDESCRIPTION, ImageJDescription(pages_, spacing_[2], time_series_, metadata_).c_str());
+    }
+
+    // Converts and compresses the strips of a page on the ITK threads and queues them for
+    // the writer thread
+    template <class TIn>
+    bool CompressPage(const TIn *page, bool scale)
+    {
+        const size_t strips = (height_ + rows_per_strip_ - 1) / rows_per_strip_;
+        EncodedPage encoded(strips);
+        std::atomic<bool> encoded_all(true);
+
+        const unsigned int threads = itk::MultiThreaderBase::GetGlobalDefaultNumberOfThreads();
+        ParallelFor(strips, threads, [&](size_t begin, size_t end) {
+            std::vector<TPixel> buffer(rows_per_strip_ * width_);
+            for (size_t strip = begin; strip < end; ++strip)
+            {
+                const size_t row = strip * rows_per_strip_;
+                const size_t rows = std::min(rows_per_strip_, height_ - row);
+                ConvertRange(page + row * width_, buffer.data(), rows * width_, scale);
+                if (!EncodeStrip(buffer.data(), width_, rows, compression_, encoded[strip]))
+                    encoded_all = false;
+            }
+        }, 1);
+
+        if (!encoded_all || !queue_->Push(std::move(encoded)))
+        {
+            failed_ = true;
+            return false;
+        }
+
+        ++written_;
+        return !failed_;
+    }
+
+    // Writer thread: appends the encoded pages in the order they were queued
+    void WriteEncodedPages()
+    {
+        EncodedPage encoded;
+        for (size_t page = 0; queue_->Pop(encoded); ++page)
+        {
+            if (failed_)
+                continue;
+
+            SetPageTags(page);
+            for (size_t strip = 0; strip < encoded.size() && !failed_; ++strip)
+            {
+                if (TIFFWriteRawStrip(tiff_, static_cast<uint32_t>(strip), encoded[strip].data(), encoded[strip].size()) < 0)
+                    failed_ = true;
+            }
+
+            if (!failed_ && page + 1 < pages_ && TIFFWriteDirectory(tiff_) == 0)
+                failed_ = true;
+        }
+    }
+
+    TIFF *tiff_ = nullptr;
+    size_t width_ = 0;
+    size_t height_ = 0;
+    size_t pages_ = 0;
+    size_t written_ = 0;
+    size_t rows_per_strip_ = 1;
+    std::array<double, kDimensions> spacing_;
+    bool time_series_ = false;
+    std::string metadata_;
+    uint16_t compression_ = COMPRESSION_NONE;
+    std::vector<TPixel> buffer_;
+    std::unique_ptr<BoundedQueue<EncodedPage>> queue_;
+    std::thread write_stage_;
+    std::atomic<bool> failed_{false};
+};
@@ -1,11 +1,18 @@
 #pragma once
 
+#include <algorithm>
+#include <cstdint>
 #include <cstdlib>
 #include <cstring>
 #include <iostream>
 #include <exception>
 #include <boost/filesystem.hpp>
 #include <limits>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <glob.h>
+#include <sys/resource.h>
 
 #include <itkImage.h>
 #include <itkCastImageFilter.h>
@@ -171,6 +178,31 @@ typename itk::Image<TPixelType, 3>::Pointer Convert2DImageTo3D(typename itk::Ima
     return image3D;
 }
 
+// Wraps a projection buffer of width x height pixels, x fastest, in a 2D image
+template <typename TPixelType>
+typename itk::Image<TPixelType, 2>::Pointer ProjectionToImage(const std::vector<TPixelType> &projection, size_t width, size_t height, double x_spacing = 1.0, double y_spacing = 1.0)
+{
+    using ProjectionType = itk::Image<TPixelType, 2>;
+
+    typename ProjectionType::SizeType size;
+    size[0] = width;
+    size[1] = height;
+    typename ProjectionType::RegionType region;
+    region.SetSize(size);
+
+    typename ProjectionType::Pointer image = ProjectionType::New();
+    image->SetRegions(region);
+    image->Allocate();
+    std::copy(projection.begin(), projection.end(), image->GetBufferPointer());
+
+    typename ProjectionType::SpacingType spacing;
+    spacing[0] = x_spacing;
+    spacing[1] = y_spacing;
+    image->SetSpacing(spacing);
+
+    return image;
+}
+
 bool IsFile(const char *path)
 {
   fs::path p(path);
@@ -194,3 +226,86 @@ std::string AppendPath(std::string path, std::string label)
 
   return out_path.string(); 
 }
+
+// Expands wildcard patterns (e.g. "stack_*.tif") into sorted file paths. Paths without
+// wildcards are kept as they are so missing files can be reported by the caller.
+std::vector<std::string> ExpandPaths(const std::vector<std::string> &patterns)
+{
+  std::vector<std::string> paths;
+  for (const std::string &pattern : patterns)
+  {
+    if (pattern.find_first_of("*?[") == std::string::npos)
+    {
+      paths.push_back(pattern);
+      continue;
+    }
+
+    glob_t matches;
+    if (glob(pattern.c_str(), 0, nullptr, &matches) == 0)
+    {
+      for (size_t i = 0; i < matches.gl_pathc; ++i)
+        paths.push_back(matches.gl_pathv[i]);
+    }
+    globfree(&matches);
+  }
+  return paths;
+}
+
+// Reads a list of paths, one per line, ignoring blank lines and lines starting with #
+std::vector<std::string> ReadPathList(const std::string &list_path)
+{
+  std::vector<std::string> paths;
+  std::ifstream list(list_path);
+  std::string line;
+  while (std::getline(list, line))
+  {
+    line.erase(line.find_last_not_of(" \t\r") + 1);
+    line.erase(0, line.find_first_not_of(" \t"));
+    if (!line.empty() && line[0] != '#')
+      paths.push_back(line);
+  }
+  return paths;
+}
+
+// Substitutes the input file name (without extension) for {} in an output path pattern
+std::string FormatOutputPath(std::string pattern, const std::string &input_path)
+{
+  const std::string stem = fs::path(input_path).stem().string();
+  size_t pos = pattern.find("{}");
+  while (pos != std::string::npos)
+  {
+    pattern.replace(pos, 2, stem);
+    pos = pattern.find("{}", pos + stem.size());
+  }
+  return pattern;
+}
+
+// 64-bit FNV-1a hash of a file's contents, used to key cached data by the file it was computed from
+uint64_t HashFile(const std::string &path)
+{
+  uint64_t hash = 14695981039346656037ULL;
+
+  std::ifstream file(path, std::ios::binary);
+  std::vector<char> buffer(1 << 20);
+  while (file)
+  {
+    file.read(buffer.data(), buffer.size());
+    std::streamsize count = file.gcount();
+    for (std::streamsize i = 0; i < count; ++i)
+    {
+      hash ^= static_cast<unsigned char>(buffer[i]);
+      hash *= 1099511628211ULL;
+    }
+  }
+
+  return hash;
+}
+
+// Peak resident memory of the process in MB
+double PeakMemoryMB()
+{
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0)
+    return 0.0;
+  return usage.ru_maxrss / 1024.0; // kilobytes on Linux
+}
@@ -1,6 +1,8 @@
 #pragma once
 
 #include "defines.h"
+#include "parallel_tiff.h"
+#include "stream.h"
 #include "utils.h"
 
 #include <itkImage.h>
@@ -18,7 +20,7 @@
 
 
 template <typename TPixel, unsigned int VDimension>
-void SaveImageAsTiff(typename itk::Image<TPixel, VDimension>::Pointer itkImage, const std::string& filename) {
+void SaveImageAsTiff(typename itk::Image<TPixel, VDimension>::Pointer itkImage, const std::string& filename, uint16_t compression = COMPRESSION_NONE) {
 
     // Ensure the image is 2D
     if (VDimension != 2) {
@@ -56,6 +58,9 @@ void SaveImageAsTiff(typename itk::Image<TPixel, VDimension>::Pointer itkImage,
     TIFFSetField(tiff, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISBLACK);
     TIFFSetField(tiff, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
     TIFFSetField(tiff, TIFFTAG_ROWSPERSTRIP, TIFFDefaultStripSize(tiff, width * sizeof(TPixel)));
+    if (compression != COMPRESSION_NONE) {
+        SetCompressionTags<TPixel>(tiff, compression);
+    }
 
     // TIFF resolution is pixels per unit, which is the inverse of spacing (unit per pixel)
     TIFFSetField(tiff, TIFFTAG_XRESOLUTION, 1.0 / spacing[0]);
@@ -72,100 +77,83 @@ void SaveImageAsTiff(typename itk::Image<TPixel, VDimension>::Pointer itkImage,
     TIFFClose(tiff);
 }
 
-template <typename TPixel, unsigned int VDimension>
-void Save3DImageAsTiffStackWithResolutions(typename itk::Image<TPixel, VDimension>::Pointer itkImage, const std::string& filename) {
+// Writes a 3D image as a TIFF stack of TPixelOut, converting it from its own pixel type a
+// strip at a time as it is written, so no converted copy of the volume is made.
+// Uncompressed stacks have their layout fixed up front and their slices written concurrently
+// by the ITK threads; compressed stacks are appended by TiffPageWriter.
+// metadata holds extra "key=value" lines appended to the ImageJ description
+template <typename TPixelOut, typename TImage>
+void WriteTiffStack(itk::SmartPointer<TImage> itkImage, const std::string& filename, bool scale = true, const std::string& metadata = "", uint16_t compression = COMPRESSION_NONE) {
 
-  // Ensure the image is 3D
-    if (VDimension != 3) {
+    // Ensure the image is 3D
+    if (TImage::ImageDimension != 3) {
         throw std::runtime_error("This function supports only 3D images.");
     }
-    
-    using ImageType = itk::Image<TPixel, VDimension>;
-    typename ImageType::RegionType region = itkImage->GetLargestPossibleRegion();
-    typename ImageType::IndexType startIndex = region.GetIndex();
-    typename ImageType::SizeType size = region.GetSize();
-    typename ImageType::SpacingType spacing = itkImage->GetSpacing();
-
-    size_t width = size[0];
-    size_t height = size[1];
-    size_t depth = size[2]; 
 
-    // Calculate estimated file size
-    size_t estimated_size = width * height * depth * sizeof(TPixel);
-    const size_t size_threshold = static_cast<size_t>(3.0 * 1024 * 1024 * 1024); // 3.0GB
+    typename TImage::SizeType size = itkImage->GetLargestPossibleRegion().GetSize();
+    typename TImage::SpacingType spacing = itkImage->GetSpacing();
 
-    // Use BigTIFF format ("w8") for files larger than 3.0GB, otherwise use standard mode ("w")
-    const char* mode = (estimated_size >= size_threshold) ? "w8" : "w";
-    TIFF* tiff = TIFFOpen(filename.c_str(), mode);
-    if (!tiff) {
-        throw std::runtime_error("Failed to open TIFF file for writing.");
-    }
+    const size_t width = size[0];
+    const size_t height = size[1];
+    const size_t depth = size[2];
+    const std::array<double, kDimensions> stack_spacing = {spacing[0], spacing[1], spacing[2]};
 
-    for (size_t slice = 0; slice < depth; ++slice) {
-        std::vector<TPixel> buffer(width * height);
-        typename ImageType::IndexType start = { {startIndex[0], startIndex[1], startIndex[2] + slice} };
-        typename ImageType::SizeType sliceSize = { {width, height, 1} };
-        typename ImageType::RegionType sliceRegion(start, sliceSize);
-
-        itk::ImageRegionConstIterator<ImageType> it(itkImage, sliceRegion);
-        size_t index = 0;
-        for (it.GoToBegin(); !it.IsAtEnd(); ++it, ++index) {
-            buffer[index] = it.Get();
-        }
+    const typename TImage::PixelType *buffer = itkImage->GetBufferPointer();
 
-        TIFFSetField(tiff, TIFFTAG_IMAGEWIDTH, static_cast<uint32_t>(width));
-        TIFFSetField(tiff, TIFFTAG_IMAGELENGTH, static_cast<uint32_t>(height));
-        TIFFSetField(tiff, TIFFTAG_SAMPLESPERPIXEL, 1); // Grayscale image
-        TIFFSetField(tiff, TIFFTAG_BITSPERSAMPLE, sizeof(TPixel) * 8);
-        TIFFSetField(tiff, TIFFTAG_ORIENTATION, ORIENTATION_TOPLEFT);
-        TIFFSetField(tiff, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISBLACK);
-        TIFFSetField(tiff, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
-        TIFFSetField(tiff, TIFFTAG_ROWSPERSTRIP, TIFFDefaultStripSize(tiff, width * sizeof(TPixel)));
-
-        // Save resolutions (TIFF resolution is pixels per unit, which is the inverse of spacing)
-        TIFFSetField(tiff, TIFFTAG_XRESOLUTION, 1.0 / spacing[0]);
-        TIFFSetField(tiff, TIFFTAG_YRESOLUTION, 1.0 / spacing[1]);
-        TIFFSetField(tiff, TIFFTAG_RESOLUTIONUNIT, RESUNIT_NONE);
-
-        // Save metadata in ImageJ format
-        if (slice == 0) { // Add ImageJ metadata to the first slice only
-            char description[512];
-            snprintf(description, sizeof(description), 
-                     "ImageJ=1.53\nimages=%zu\nslices=%zu\nspacing=%.6f\nunit=pixel\nhyperstack=false\nmode=grayscale\nloop=false", 
-                     depth, depth, spacing[2]);
-            TIFFSetField(tiff, TIFFTAG_IMAGEDESCRIPTION, description);
+    if (compression == COMPRESSION_NONE) {
+        ParallelTiffWriter<TPixelOut> writer;
+        if (!writer.Open(filename, width, height, depth, stack_spacing, false, metadata)) {
+            throw std::runtime_error("Failed to open TIFF file for writing.");
         }
 
-        for (size_t row = 0; row < height; ++row) {
-            if (TIFFWriteScanline(tiff, buffer.data() + row * width, row, 0) < 0) {
-                TIFFClose(tiff);
-                throw std::runtime_error("Failed to write TIFF scanline.");
+        const unsigned int threads = itk::MultiThreaderBase::GetGlobalDefaultNumberOfThreads();
+        ParallelFor(depth, threads, [&](size_t begin, size_t end) {
+            for (size_t slice = begin; slice < end; ++slice) {
+                if (!writer.WritePage(slice, buffer + slice * width * height, scale))
+                    break;
             }
+        }, 1);
+
+        if (!writer.Close()) {
+            throw std::runtime_error("Failed to write TIFF stack.");
         }
+        return;
+    }
 
-        if (slice < depth - 1) {
-            if (TIFFWriteDirectory(tiff) == 0) {
-                TIFFClose(tiff);
-                throw std::runtime_error("Failed to write TIFF directory for slice.");
-            }
+    TiffPageWriter<TPixelOut> writer;
+    if (!writer.Open(filename, width, height, depth, stack_spacing, false, metadata, compression)) {
+        throw std::runtime_error("Failed to open TIFF file for writing.");
+    }
+
+    for (size_t slice = 0; slice < depth; ++slice) {
+        if (!writer.WritePage(buffer + slice * width * height, scale)) {
+            throw std::runtime_error("Failed to write TIFF slice.");
         }
     }
 
-    TIFFClose(tiff);
+    if (!writer.Close()) {
+        throw std::runtime_error("Failed to write TIFF stack.");
+    }
+}
+
+// metadata holds extra "key=value" lines appended to the ImageJ description
+template <typename TPixel, unsigned int VDimension>
+void Save3DImageAsTiffStackWithResolutions(typename itk::Image<TPixel, VDimension>::Pointer itkImage, const std::string& filename, const std::string& metadata = "", uint16_t compression = COMPRESSION_NONE) {
+    WriteTiffStack<TPixel>(itkImage, filename, false, metadata, compression);
 }
 
 template <class TImageIn, class TImageOut>
-void WriteImageFile(typename TImageIn::Pointer image_in, std::string out_path, bool verbose=false, bool fix_spacings=true, bool scale=true)
+void WriteImageFile(typename TImageIn::Pointer image_in, std::string out_path, bool verbose=false, bool fix_spacings=true, bool scale=true, const std::string &metadata="", uint16_t compression=COMPRESSION_NONE)
 {
-  typename TImageOut::Pointer image_output = ConvertImage<TImageIn,TImageOut>(image_in, scale);
-
   if constexpr (TImageOut::ImageDimension == 2)
   {
-    SaveImageAsTiff<typename TImageOut::PixelType, TImageOut::ImageDimension>(image_output, out_path);
+    typename TImageOut::Pointer image_output = ConvertImage<TImageIn,TImageOut>(image_in, scale);
+    SaveImageAsTiff<typename TImageOut::PixelType, TImageOut::ImageDimension>(image_output, out_path, compression);
   }
   else if constexpr (TImageOut::ImageDimension == 3)
   {
-    Save3DImageAsTiffStackWithResolutions<typename TImageOut::PixelType, TImageOut::ImageDimension>(image_output, out_path);
+    // stacks are converted while they are written
+    WriteTiffStack<typename TImageOut::PixelType>(image_in, out_path, scale, metadata, compression);
   }
   else
   {
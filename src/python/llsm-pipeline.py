@@ -321,7 +321,7 @@ def load_configs(path):
 
     # sanitize decon configs
     if 'decon' in configs:
-        supported_opts = ['xy-res','n', 'bit-depth', 'subtract', 'executable_path']
+        supported_opts = ['xy-res','n', 'bit-depth', 'subtract', 'plan-rigor', 'wisdom-dir', 'max-memory', 'accelerate', 'stop', 'tolerance', 'executable_path']
         for key in list(configs['decon']):
             if key not in supported_opts:
                 print('WARNING: decon option \'%s\' in config.json is not supported' % key)
@@ -353,6 +353,39 @@ def load_configs(path):
                 exit('ERROR: decon subtract value \'%s\' in config.json must be a float' % configs['decon']['subtract'])
             configs['decon']['subtract'] = {'flag': '-s', 'arg': configs['decon']['subtract']}
 
+        if 'plan-rigor' in configs['decon']:
+            if configs['decon']['plan-rigor'] not in ['estimate', 'measure', 'patient', 'exhaustive']:
+                exit('ERROR: decon plan-rigor \'%s\' in config.json must be estimate, measure, patient, or exhaustive' % configs['decon']['plan-rigor'])
+            configs['decon']['plan-rigor'] = {'flag': '--plan-rigor', 'arg': configs['decon']['plan-rigor']}
+
+        if 'wisdom-dir' in configs['decon']:
+            if not type(configs['decon']['wisdom-dir']) is str:
+                exit('ERROR: decon wisdom-dir \'%s\' in config.json must be a string' % configs['decon']['wisdom-dir'])
+            configs['decon']['wisdom-dir'] = {'flag': '--wisdom-dir', 'arg': configs['decon']['wisdom-dir']}
+
+        if 'max-memory' in configs['decon']:
+            if not type(configs['decon']['max-memory']) in [int, float] or configs['decon']['max-memory'] < 0:
+                exit('ERROR: decon max-memory \'%s\' in config.json must be a non-negative number of GB' % configs['decon']['max-memory'])
+            configs['decon']['max-memory'] = {'flag': '-m', 'arg': configs['decon']['max-memory']}
+
+        if 'accelerate' in configs['decon']:
+            if not type(configs['decon']['accelerate']) is bool:
+                exit('ERROR: decon accelerate \'%s\' in config.json must be true or false' % configs['decon']['accelerate'])
+            if configs['decon']['accelerate']:
+                configs['decon']['accelerate'] = {'flag': '-a'}
+            else:
+                del configs['decon']['accelerate']
+
+        if 'stop' in configs['decon']:
+            if configs['decon']['stop'] not in ['none', 'change', 'divergence']:
+                exit('ERROR: decon stop \'%s\' in config.json must be none, change, or divergence' % configs['decon']['stop'])
+            configs['decon']['stop'] = {'flag': '--stop', 'arg': configs['decon']['stop']}
+
+        if 'tolerance' in configs['decon']:
+            if not type(configs['decon']['tolerance']) is float:
+                exit('ERROR: decon tolerance \'%s\' in config.json must be a float' % configs['decon']['tolerance'])
+            configs['decon']['tolerance'] = {'flag': '--tolerance', 'arg': configs['decon']['tolerance']}
+
         if 'psf' not in configs['paths']:
             exit('ERROR: decon enabled, but no psf parameters found in config file')
 